@@ -1,511 +1,1208 @@
 #include "CANFilter.h"
+#include "CANFilterBasic.h"
+
+#include <algorithm>
 
 namespace CANFilter
 {
+    using namespace detail;
+
     /* Private variables/functions */
     namespace
     {
-        //Have to keep track of how many IDs we have
-        unsigned short stdCANCount = 0;     //Word Size: 1/2
-        unsigned short stdGrpCANCount = 0;  //Word Size: 1
-        unsigned short extCANCount = 0;     //Word Size: 1
-        unsigned short extGrpCANCount = 0;  //Word Size: 2
+        //The acceptance filter of the LPC1768, which the free functions and
+        //the helper classes below all work on
+        LPC1768Filter lpc;
+    }
 
-        /**
-         * Calculate the start and end points of the memory sections. You must
-         * take the size, in words * 4, that will be occupied by each section.
-         * So, offset + (#words * 4) is the equation used for this.
-         */
-        void calculateAddresses()
-        {
-            //Set the Mode Register to bypass, allow writes to registers
-            LPC_CANAF->AFMR = 1;
+    void setFilterMode(FilterMode mode) {
+        lpc.setFilterMode(mode);
+    }
 
-            //Beginning of the Standard (11-bit) CAN message filter
-            LPC_CANAF->SFF_sa       = 0;
-            //Beginning of the Standard (11-bit) Group CAN message filter
-            LPC_CANAF->SFF_GRP_sa   = LPC_CANAF->SFF_sa + (((stdCANCount + 1) / 2) * 4);
-            //Beginning of the Extended (29-bit) CAN message filter
-            LPC_CANAF->EFF_sa       = LPC_CANAF->SFF_GRP_sa + (stdGrpCANCount * 4);
-            //Beginning of the Extended (29-bit) Group CAN message filter
-            LPC_CANAF->EFF_GRP_sa   = LPC_CANAF->EFF_sa + (extCANCount * 4);
-            //End of the acceptance filter
-            LPC_CANAF->ENDofTable   = LPC_CANAF->EFF_GRP_sa + ((extGrpCANCount * 2) * 4);
+    void setDoubleBuffering(bool enable) {
+        lpc.setDoubleBuffering(enable);
+    }
 
-            //Set the Mode Register to operating, use the filter
-            LPC_CANAF->AFMR = 0;
-        }
+    int registerHandler(CANController SCC, uint32_t mask, bool extended, FilterHandler handler) {
+        return lpc.registerHandler(SCC, mask, extended, handler);
+    }
 
-        /**
-         * Shift all of the items up in the filter by 1. Duplicate entry at index.
-         */
-        void upShiftFilter(unsigned short index) {
-            //The starting data to be modified
-            uint32_t bufferStart = LPC_CANAF_RAM->mask[index];
-            //The next data to be modified
-            uint32_t bufferNext;
-
-            //Go through all the standard filters
-            while(index < (LPC_CANAF->SFF_GRP_sa / 4)) {
-                index++;
-                //Save the current state of the memory we are modifying
-                bufferNext = LPC_CANAF_RAM->mask[index];
-                //[index+1] = [index+1] >> 16 | [index] << 16
-                LPC_CANAF_RAM->mask[index] = (bufferNext >> 16) | (bufferStart << 16);
-                //The next item is now the starting data we use
-                bufferStart = bufferNext;
-            }
+    int registerHandler(CANController SCC, uint32_t start, uint32_t end, bool extended, FilterHandler handler) {
+        return lpc.registerHandler(SCC, start, end, extended, handler);
+    }
 
-            //Go through all other filters
-            while(index < (LPC_CANAF->ENDofTable / 4)){
-                index++;
-                //Save the current state of the memory we are modifying
-                bufferNext = LPC_CANAF_RAM->mask[index];
-                //Move the previous value into the current address
-                LPC_CANAF_RAM->mask[index] = bufferStart;
-                //The next item is now the starting data we use
-                bufferStart = bufferNext;
-            }
-        }
+    void clearHandlers() {
+        lpc.clearHandlers();
+    }
 
-        /**
-         * Shift only the standard filters up in the filter by 1. Duplicate entry
-         * in the LSB of index.
-         */
-        void upShiftFilterStd(unsigned short index) {
-            //The starting data to be modified
-            uint32_t bufferStart = LPC_CANAF_RAM->mask[index];
-            //The next data to be modified
-            uint32_t bufferNext;
-
-            //Go through all the standard filters but not passed it (since we
-            //increment the index immediately, we include the -1)
-            while(index < (LPC_CANAF->SFF_GRP_sa / 4) - 1) {
-                index++;
-                //Save the current state of the memory we are modifying
-                bufferNext = LPC_CANAF_RAM->mask[index];
-                //[index+1] = [index+1] >> 16 | [index] << 16
-                LPC_CANAF_RAM->mask[index] = (bufferNext >> 16) | (bufferStart << 16);
-                //The next item is now the starting data we use
-                bufferStart = bufferNext;
-            }
-        }
+    bool dispatch(unsigned short index, void * frame) {
+        return lpc.dispatch(index, frame);
+    }
 
-        /**
-         * Shift all of the items, not standard, down in the filter by 1. This
-         * will delete the item at index.
-         */
-        void downShiftFilter(unsigned short index) {
-            //Note, don't need a +1 on the while loop because we don't need to
-            //overwrite the last item, just change how many items are in the
-            //array. So if we put index = end, nothing happens.
+    void resetFilter() {
+        lpc.resetFilter();
+    }
 
-            while(index < (LPC_CANAF->ENDofTable / 4)){
-                index++;
-                //Take the next item, and put it at index
-                LPC_CANAF_RAM->mask[index-1] = LPC_CANAF_RAM->mask[index];
-            }
-        }
+    int insertStandardFilter(CANController SCC, uint32_t mask) {
+        return lpc.insertStandardFilter(SCC, mask);
+    }
 
-        /**
-         * Shift only the standard filters down in the filter by 1. This will
-         * delete the MSB at index.
-         */
-        void downShiftFilterStd(unsigned short index) {
-            //Note, need a +1 so that the LSB of the end index are shifted to
-            //the MSB. This will bring in "random" data to the filter. So, if
-            //index = end, the LSB will be shifted to the MSB.
-            while(index < (LPC_CANAF->SFF_GRP_sa / 4) + 1){
-                index++;
-                //[index] = [index] << 16 | [index+1] >> 16
-                LPC_CANAF_RAM->mask[index-1] = (LPC_CANAF_RAM->mask[index-1] << 16) | (LPC_CANAF_RAM->mask[index] >> 16);
+    int insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return lpc.insertStandardGroupFilter(SCC, start, end);
+    }
+
+    int insertExtendedFilter(CANController SCC, uint32_t mask) {
+        return lpc.insertExtendedFilter(SCC, mask);
+    }
+
+    int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return lpc.insertExtendedGroupFilter(SCC, start, end);
+    }
+
+    int insertMaskFilter(CANController SCC, uint32_t code, uint32_t mask, bool extended) {
+        return lpc.insertMaskFilter(SCC, code, mask, extended);
+    }
+
+    int maskFilterWords(uint32_t code, uint32_t mask, bool extended) {
+        return MaskBlocks(CANController::CAN1, code, mask, extended).words();
+    }
+
+    int loadStaticTable(const uint32_t * words, unsigned short size, const unsigned short counts[4]) {
+        return lpc.loadStaticTable(words, size, counts);
+    }
+#ifdef CANFILTER_SNAPSHOTS
+    int saveFilterSnapshot(uint32_t address) {
+        return lpc.saveFilterSnapshot(address);
+    }
+
+    int loadFilterSnapshot(uint32_t address) {
+        return lpc.loadFilterSnapshot(address);
+    }
+#endif
+
+    int updateStandardFilter(CANController SCC, uint32_t oldMask, uint32_t newMask) {
+        return lpc.updateStandardFilter(SCC, oldMask, newMask);
+    }
+
+    int updateStandardGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd) {
+        return lpc.updateStandardGroupFilter(SCC, oldStart, oldEnd, newStart, newEnd);
+    }
+
+    int updateExtendedFilter(CANController SCC, uint32_t oldMask, uint32_t newMask) {
+        return lpc.updateExtendedFilter(SCC, oldMask, newMask);
+    }
+
+    int updateExtendedGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd) {
+        return lpc.updateExtendedGroupFilter(SCC, oldStart, oldEnd, newStart, newEnd);
+    }
+
+    int deleteStandardFilter(CANController SCC, uint32_t mask) {
+        return lpc.deleteStandardFilter(SCC, mask);
+    }
+
+    int deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return lpc.deleteStandardGroupFilter(SCC, start, end);
+    }
+
+    int deleteExtendedFilter(CANController SCC, uint32_t mask) {
+        return lpc.deleteExtendedFilter(SCC, mask);
+    }
+
+    int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return lpc.deleteExtendedGroupFilter(SCC, start, end);
+    }
+
+    int disableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+        return lpc.disableFilter(SCC, section, start, end);
+    }
+
+    int disableFilter(CANController SCC, FilterSection section, uint32_t mask) {
+        return lpc.disableFilter(SCC, section, mask);
+    }
+
+    int disableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count) {
+        return lpc.disableFilters(SCC, section, masks, count);
+    }
+
+    int enableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+        return lpc.enableFilter(SCC, section, start, end);
+    }
+
+    int enableFilter(CANController SCC, FilterSection section, uint32_t mask) {
+        return lpc.enableFilter(SCC, section, mask);
+    }
+
+    int enableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count) {
+        return lpc.enableFilters(SCC, section, masks, count);
+    }
+
+    int compactFilters() {
+        return lpc.compactFilters();
+    }
+
+    void enableFullCAN(bool enable) {
+        lpc.enableFullCAN(enable);
+    }
+
+    int insertFullCANFilter(CANController SCC, uint32_t mask) {
+        return lpc.insertFullCANFilter(SCC, mask);
+    }
+
+    int deleteFullCANFilter(CANController SCC, uint32_t mask) {
+        return lpc.deleteFullCANFilter(SCC, mask);
+    }
+
+    int fullCANIndex(CANController SCC, uint32_t mask) {
+        return lpc.fullCANIndex(SCC, mask);
+    }
+
+    int readFullCANObject(unsigned short index, FullCANObject & object) {
+        return lpc.readFullCANObject(index, object);
+    }
+
+    int verifyMirror() {
+        return lpc.verifyMirror();
+    }
+
+    bool isAccepted(CANController SCC, uint32_t id, bool extended) {
+        return lpc.isAccepted(SCC, id, extended);
+    }
+
+    unsigned short count(FilterSection section) {
+        return lpc.count(section);
+    }
+
+    FilterRange sectionFilters(FilterSection section) {
+        return lpc.sectionFilters(section);
+    }
+
+    int applyFilterSet(CANController SCC, FilterSet & set) {
+        return lpc.applyFilterSet(SCC, set);
+    }
+
+    int clearController(CANController SCC) {
+        return lpc.clearController(SCC);
+    }
+
+    int replaceController(CANController SCC, FilterSet & set) {
+        return lpc.replaceController(SCC, set);
+    }
+
+    int copyController(CANController from, CANController to) {
+        return lpc.copyController(from, to);
+    }
+
+    int commitStep(unsigned short budget) {
+        return lpc.commitStep(budget);
+    }
+
+    void cancelCommit() {
+        lpc.cancelCommit();
+    }
+
+    void getCommitProgress(CommitProgress & progress) {
+        lpc.getCommitProgress(progress);
+    }
+#ifdef CANFILTER_STATS
+    void getStats(FilterStats & stats) {
+        lpc.getStats(stats);
+    }
+
+    void resetStats() {
+        lpc.resetStats();
+    }
+#endif
+
+    FilterIterator::FilterIterator(FilterSection section, const uint32_t * words, unsigned short count, unsigned short index,
+                                   const DisabledFilter * disabled, unsigned short disabledCount)
+        : section(section), words(words), count(count), index(index), disabled(disabled), disabledCount(disabledCount) {}
+
+    FilterView FilterIterator::operator*() const {
+        FilterEntry entry = decodeEntry(section, words, index);
+        bool extended = (section == FilterSection::extended || section == FilterSection::extendedGroup);
+
+        FilterView view;
+        view.SCC = static_cast<CANController>(entryController(section, entry));
+        view.start = entry.first & (extended ? 0x1FFFFFFF : 0x000007FF);
+        view.end = entry.last & (extended ? 0x1FFFFFFF : 0x000007FF);
+        view.active = !isDisabled(section, entry);
+        if (!view.active || !extended)
+            return view;
+
+        //A disabled extended filter is overwritten with a copy of the filter
+        //before it, which lands after that filter, or of the one after it,
+        //which lands in front. Count the copies of this entry each way.
+        unsigned short before = 0;
+        unsigned short after = 0;
+        for (unsigned short i = 0; i < disabledCount; i++) {
+            const DisabledFilter & record = disabled[i];
+            if (!record.placed || record.section != static_cast<uint8_t>(section) || !(record.placeholder == entry))
+                continue;
+            if (record.entry < entry) {
+                before++;
+            } else {
+                after++;
             }
         }
+        if (before == 0 && after == 0)
+            return view;
 
-        /**
-         * Sanitize the standard filters being input, so that any extra bits are removed
-         * and the controller bits are placed correctly.
-         */
-        void sanitizeStdMask(CANController SCC, uint32_t & mask) {
-            //Only have 11 bits for the mask, remove any possible extra
-            mask &= 0x000007FF;
-            //The controller bits begin at bit 13
-            mask |= (static_cast<int>(SCC) << 13);
-        }
+        //Where this item sits in the run of equal entries
+        unsigned short first = index;
+        while (first > 0 && decodeEntry(section, words, first - 1) == entry)
+            first--;
+        unsigned short last = index;
+        while (last + 1 < count && decodeEntry(section, words, last + 1) == entry)
+            last++;
 
-        /**
-         * Sanitize the extended filters being input, so that any extra bits are removed
-         * and the controller bits are placed correctly.
-         */
-        void sanitizeExtMask(CANController SCC, uint32_t & mask) {
-            //Only have 29 bits for the mask, remove any possible extra
-            mask &= 0x1FFFFFFF;
-            //The controller bits begin at bit 29
-            mask |= (static_cast<int>(SCC) << 29);
-        }
+        view.active = (index - first >= before) && (last - index >= after);
+
+        return view;
     }
 
-    void setFilterMode(FilterMode mode)
-    {
-        LPC_CANAF->AFMR = static_cast<int>(mode);
+    FilterIterator & FilterIterator::operator++() {
+        index++;
+        return *this;
     }
 
-    void resetFilter()
-    {
-        //Reset our item count
-        stdCANCount = 0;
-        stdGrpCANCount = 0;
-        extCANCount = 0;
-        extGrpCANCount = 0;
+    bool FilterIterator::operator==(const FilterIterator & other) const {
+        return index == other.index && words == other.words && section == other.section;
+    }
+
+    bool FilterIterator::operator!=(const FilterIterator & other) const {
+        return !(*this == other);
+    }
 
-        //Set the Mode Register to bypass, leave to accept all messages
-        LPC_CANAF->AFMR = 1;
+    FilterRange::FilterRange(FilterSection section, const uint32_t * words, unsigned short count,
+                             const DisabledFilter * disabled, unsigned short disabledCount)
+        : section(section), words(words), count(count), disabled(disabled), disabledCount(disabledCount) {}
 
-        //Set the Look-Up Table starts to 0 (All off)
-        LPC_CANAF->SFF_sa = 0;
-        LPC_CANAF->SFF_GRP_sa = 0;
-        LPC_CANAF->EFF_sa = 0;
-        LPC_CANAF->EFF_GRP_sa = 0;
-        LPC_CANAF->ENDofTable = 0;
+    FilterIterator FilterRange::begin() const {
+        return FilterIterator(section, words, count, 0, disabled, disabledCount);
     }
 
-    int insertStandardFilter(CANController SCC, uint32_t mask) {
-        //Make sure the table isn't full
-        if((LPC_CANAF->ENDofTable / 4) >= 512)
+    FilterIterator FilterRange::end() const {
+        return FilterIterator(section, words, count, count, disabled, disabledCount);
+    }
+
+    unsigned short FilterRange::size() const {
+        return count;
+    }
+
+    FilterSet::FilterSet() : entryCount(0) {}
+
+    int FilterSet::insertStandardFilter(uint32_t mask) {
+        return add(FilterSection::standard, mask, mask);
+    }
+    int FilterSet::insertStandardGroupFilter(uint32_t start, uint32_t end) {
+        return add(FilterSection::standardGroup, start, end);
+    }
+    int FilterSet::insertExtendedFilter(uint32_t mask) {
+        return add(FilterSection::extended, mask, mask);
+    }
+    int FilterSet::insertExtendedGroupFilter(uint32_t start, uint32_t end) {
+        return add(FilterSection::extendedGroup, start, end);
+    }
+
+    int FilterSet::add(FilterSection section, uint32_t first, uint32_t last) {
+        if (entryCount >= CANFILTER_SET_SIZE)
             return -1;
 
-        //Sanitize inputs
-        sanitizeStdMask(SCC, mask);
+        //The controller bits are filled in by applyFilterSet()
+        FilterOperation & entry = entries[entryCount++];
+        entry.first = first;
+        entry.last = last;
+        entry.section = static_cast<uint8_t>(section);
+        entry.remove = false;
+        entry.order = 0;
 
-        //Index of the insert location. Normal index * 2; +1 if LSB
-        unsigned short index;
-        //Start at the beginning of all standard items. End at the start of the
-        //standard group filter.
-        for (int i = (LPC_CANAF->SFF_sa / 4); i < (LPC_CANAF->SFF_GRP_sa / 4); i++) {
-            //Check MSB
-            if (i < (LPC_CANAF_RAM->mask[index] >> 16)) {
-                index = i * 2;
-                break;
-            }
-            if (i < (LPC_CANAF_RAM->mask[index] & 0x0000FFFF)) {
-                index = i * 2 + 1;
-                break;
-            }
-        }
+        return 0;
+    }
 
-        //Have to set the AFMR to modify mode
-        LPC_CANAF->AFMR = 1;
+    void FilterSet::clear() {
+        entryCount = 0;
+    }
 
-        //If we have an even number of items, need to make a new spot
-        if (stdCANCount % 2 == 0) {
-            upShiftFilter(index / 2);
-        //If we have an odd number of items, and we are not at the end of the filter
-        //shift only the standard ids
-        } else if ((index / 2) < (LPC_CANAF->SFF_GRP_sa / 4)) {
-            upShiftFilterStd(index / 2);
-        }
+    unsigned short FilterSet::size() const {
+        return entryCount;
+    }
 
-        //Item is in MSB
-        if (index % 2 == 0
-            //Or index is at the end of the array, && mask is less than current MSB
-            || ((index / 2) == (LPC_CANAF->SFF_GRP_sa / 4) && mask < (LPC_CANAF_RAM->mask[index] >> 16))) {
+    static_assert((CANFILTER_QUEUE_DEPTH & (CANFILTER_QUEUE_DEPTH - 1)) == 0,
+                  "CANFILTER_QUEUE_DEPTH must be a power of two");
 
-            //Put the new mask in the MSB
-            LPC_CANAF_RAM->mask[index / 2] = (mask << 16) | (LPC_CANAF_RAM->mask[index] >> 16);
-        } else {
-            //Put the new mask in the LSB
-            LPC_CANAF_RAM->mask[index / 2] = (LPC_CANAF_RAM->mask[index] & 0xFFFF0000) | (mask);
+    namespace
+    {
+        //Kinds of queued commands
+        const uint8_t commandInsert = 0;
+        const uint8_t commandDelete = 1;
+        const uint8_t commandUpdate = 2;
+        const uint8_t commandSkip = 3;
+    }
+
+    FilterQueue::FilterQueue() : tail(0), head(0), completed(0), droppedBatches(0), notify(0) {
+        for (uint32_t i = 0; i < CANFILTER_QUEUE_DEPTH; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        for (unsigned short i = 0; i < 2; i++) {
+            droppedFirst[i].store(0, std::memory_order_relaxed);
+            droppedLast[i].store(0, std::memory_order_relaxed);
         }
+    }
 
-        stdCANCount++;
-        calculateAddresses();
+    FilterTicket FilterQueue::postInsert(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+        FilterEntry entry = sanitizeEntry(SCC, section, start, end);
+        Command command = { entry.first, entry.last, 0, 0, static_cast<uint8_t>(section), commandInsert };
+        return post(command);
+    }
+    FilterTicket FilterQueue::postInsert(CANController SCC, FilterSection section, uint32_t mask) {
+        return postInsert(SCC, section, mask, mask);
+    }
+    FilterTicket FilterQueue::postDelete(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+        FilterEntry entry = sanitizeEntry(SCC, section, start, end);
+        Command command = { entry.first, entry.last, 0, 0, static_cast<uint8_t>(section), commandDelete };
+        return post(command);
+    }
+    FilterTicket FilterQueue::postDelete(CANController SCC, FilterSection section, uint32_t mask) {
+        return postDelete(SCC, section, mask, mask);
+    }
+    FilterTicket FilterQueue::postUpdate(CANController SCC, FilterSection section, uint32_t oldStart, uint32_t oldEnd,
+                                         uint32_t newStart, uint32_t newEnd) {
+        FilterEntry from = sanitizeEntry(SCC, section, oldStart, oldEnd);
+        FilterEntry to = sanitizeEntry(SCC, section, newStart, newEnd);
+        Command command = { from.first, from.last, to.first, to.last, static_cast<uint8_t>(section), commandUpdate };
+        return post(command);
+    }
 
-        return 0;
+    FilterTicket FilterQueue::post(const Command & command) {
+        uint32_t position = tail.load(std::memory_order_relaxed);
+
+        //Claim a slot. Only retries when another producer got there first.
+        while (true) {
+            Slot & slot = slots[position & (CANFILTER_QUEUE_DEPTH - 1)];
+            uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+            int32_t difference = static_cast<int32_t>(sequence - position);
+
+            if (difference == 0) {
+                if (!tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    continue;
+
+                //Ticket 0 means the queue was full, so when the positions wrap
+                //around, the one that would get it holds a command that does
+                //nothing and the next one is claimed instead
+                bool skip = (position + 1 == 0);
+                if (skip) {
+                    slot.command.kind = commandSkip;
+                } else {
+                    slot.command = command;
+                }
+                //Hand the slot to the worker
+                slot.sequence.store(position + 1, std::memory_order_release);
+
+                if (!skip)
+                    return position + 1;
+                position++;
+            } else if (difference < 0) {
+                //The worker hasn't drained this slot yet
+                return 0;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
     }
-    int insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Make sure the table isn't full
-        if((LPC_CANAF->ENDofTable / 4) >= 512)
-            return -1;
 
-        //Sanitize inputs
-        sanitizeStdMask(SCC, start);
-        sanitizeStdMask(SCC, end);
-        //Put the items into one int
-        uint32_t mask = (start << 16) & end;
-
-        //Index of the insert location.
-        unsigned short index;
-        //Start at the beginning of all standard group items. End at the start of the
-        //extended group filter.
-        for (index = (LPC_CANAF->SFF_GRP_sa / 4); index < (LPC_CANAF->EFF_sa / 4); index++) {
-            //Check if this is the insert location
-            if (mask < LPC_CANAF_RAM->mask[index]) {
+    int FilterQueue::process() {
+        CANFILTER_MEASURE(lpc, commit);
+
+        unsigned short count = 0;
+        uint32_t first = head + 1;
+
+        //Take every command that has been fully posted, in order. Stop after
+        //one lap, since producers refill the slots as they are freed.
+        for (uint32_t taken = 0; taken < CANFILTER_QUEUE_DEPTH; taken++) {
+            Slot & slot = slots[head & (CANFILTER_QUEUE_DEPTH - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1)
                 break;
+
+            const Command & command = slot.command;
+            bool present = (command.kind != commandSkip);
+
+            if (command.kind == commandUpdate) {
+                //Like the update functions, only change a filter that is
+                //there. An earlier command of the batch decides over the table.
+                present = lpc.findEntry(static_cast<FilterSection>(command.section), { command.first, command.last }) >= 0;
+                for (unsigned short i = 0; i < count; i++) {
+                    if (operations[i].section == command.section && operations[i].first == command.first
+                        && operations[i].last == command.last)
+                        present = !operations[i].remove;
+                }
             }
-        }
 
-        //Have to set the AFMR to modify mode
-        LPC_CANAF->AFMR = 1;
+            if (present) {
+                FilterOperation & operation = operations[count];
+                operation.first = command.first;
+                operation.last = command.last;
+                operation.section = command.section;
+                operation.remove = (command.kind != commandInsert);
+                operation.order = count++;
+
+                if (command.kind == commandUpdate) {
+                    FilterOperation & insert = operations[count];
+                    insert.first = command.newFirst;
+                    insert.last = command.newLast;
+                    insert.section = command.section;
+                    insert.remove = false;
+                    insert.order = count++;
+                }
+            }
 
-        //Make space for new mask
-        upShiftFilter(index);
+            //Give the slot back to the producers, a lap later
+            slot.sequence.store(head + CANFILTER_QUEUE_DEPTH, std::memory_order_release);
+            head++;
+        }
 
-        //Insert new mask
-        LPC_CANAF_RAM->mask[index] = mask;
+        if (head + 1 == first)
+            return 0;
+
+        unsigned short counts[4];
+        unsigned short words;
+        unsigned short missing;
+        int result = 0;
+
+        //Every command in one rewrite of the table
+        if (count > 0 && lpc.buildTable(operations, count, false, 0, counts, words, missing) != 0) {
+            result = -1;
+
+            //Fill the pair done() isn't reading, then publish it with one
+            //store. The fence keeps these writes after the last publish.
+            uint32_t batch = droppedBatches.load(std::memory_order_relaxed) + 1;
+            std::atomic_thread_fence(std::memory_order_release);
+            droppedFirst[batch % 2].store(first, std::memory_order_relaxed);
+            droppedLast[batch % 2].store(head, std::memory_order_relaxed);
+            droppedBatches.store(batch, std::memory_order_release);
+        } else if (count > 0) {
+            lpc.writeTable(lpc.tableImage, words, counts);
+        }
 
-        stdGrpCANCount++;
-        calculateAddresses();
+        completed.store(head, std::memory_order_release);
+        if (notify)
+            notify(head, result);
 
-        return 0;
+        return result;
     }
-    int insertExtendedFilter(CANController SCC, uint32_t mask) {
-        //Make sure the table isn't full
-        if((LPC_CANAF->ENDofTable / 4) >= 512)
-            return -1;
-
-        //Sanitize inputs
-        sanitizeExtMask(SCC, mask);
 
-        //Index of the insert location.
-        unsigned short index;
-        //Start at the beginning of all standard group items. End at the start of the
-        //extended group filter.
-        for (index = (LPC_CANAF->EFF_sa / 4); index < (LPC_CANAF->EFF_GRP_sa / 4); index++) {
-            //Check if this is the insert location
-            if (mask < LPC_CANAF_RAM->mask[index]) {
+    bool FilterQueue::done(FilterTicket ticket) const {
+        if (static_cast<int32_t>(completed.load(std::memory_order_acquire) - ticket) < 0)
+            return false;
+
+        //A batch dropped meanwhile may be rewriting the pair two drops on, so
+        //read again if the count moved. Never waits on the worker.
+        uint32_t batch = droppedBatches.load(std::memory_order_acquire);
+        uint32_t first;
+        uint32_t last;
+        while (true) {
+            first = droppedFirst[batch % 2].load(std::memory_order_relaxed);
+            last = droppedLast[batch % 2].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            uint32_t again = droppedBatches.load(std::memory_order_relaxed);
+            if (again == batch)
                 break;
-            }
+            batch = again;
         }
 
-        //Have to set the AFMR to modify mode
-        LPC_CANAF->AFMR = 1;
+        //Written unless it was in the last batch that didn't fit
+        return ticket - first > last - first;
+    }
 
-        //Make space for new mask
-        upShiftFilter(index);
+    void FilterQueue::setNotify(FilterQueueNotify callback) {
+        notify = callback;
+    }
 
-        //Insert new mask
-        LPC_CANAF_RAM->mask[index] = mask;
+    FilterTransaction::FilterTransaction() : operationCount(0) {}
 
-        extCANCount++;
-        calculateAddresses();
+    int FilterTransaction::insertStandardFilter(CANController SCC, uint32_t mask) {
+        sanitizeStdMask(SCC, mask);
+        return stage(FilterSection::standard, false, mask, mask);
+    }
+    int FilterTransaction::insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        sanitizeStdMask(SCC, start);
+        sanitizeStdMask(SCC, end);
+        return stage(FilterSection::standardGroup, false, start, end);
+    }
+    int FilterTransaction::insertExtendedFilter(CANController SCC, uint32_t mask) {
+        sanitizeExtMask(SCC, mask);
+        return stage(FilterSection::extended, false, mask, mask);
+    }
+    int FilterTransaction::insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        sanitizeExtMask(SCC, start);
+        sanitizeExtMask(SCC, end);
+        return stage(FilterSection::extendedGroup, false, start, end);
+    }
+
+    int FilterTransaction::insertMaskFilter(CANController SCC, uint32_t code, uint32_t mask, bool extended) {
+        MaskBlocks blocks(SCC, code, mask, extended);
+
+        //Make sure every block can be staged before staging any
+        uint32_t entries = blocks.singles() ? blocks.blocks() * blocks.size : blocks.blocks();
+        if (operationCount + entries > CANFILTER_TRANSACTION_DEPTH)
+            return -1;
+
+        FilterEntry entry;
+        while (blocks.peek(entry)) {
+            stage(blocks.section(), false, entry.first, entry.last);
+            blocks.advance();
+        }
 
         return 0;
     }
-    int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Make sure the table isn't full, with 2 open spaces
-        if((LPC_CANAF->ENDofTable / 4) + 1 >= 512)
-            return -1;
 
-        //Sanitize inputs
+    int FilterTransaction::deleteStandardFilter(CANController SCC, uint32_t mask) {
+        sanitizeStdMask(SCC, mask);
+        return stage(FilterSection::standard, true, mask, mask);
+    }
+    int FilterTransaction::deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        sanitizeStdMask(SCC, start);
+        sanitizeStdMask(SCC, end);
+        return stage(FilterSection::standardGroup, true, start, end);
+    }
+    int FilterTransaction::deleteExtendedFilter(CANController SCC, uint32_t mask) {
+        sanitizeExtMask(SCC, mask);
+        return stage(FilterSection::extended, true, mask, mask);
+    }
+    int FilterTransaction::deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
         sanitizeExtMask(SCC, start);
         sanitizeExtMask(SCC, end);
+        return stage(FilterSection::extendedGroup, true, start, end);
+    }
 
-        //Index of the insert location.
-        unsigned short index;
-        //Start at the beginning of all standard group items. End at the start of the
-        //extended group filter.
-        for (index = (LPC_CANAF->EFF_GRP_sa / 4); index < (LPC_CANAF->ENDofTable / 4); index += 2) {
-            //Check if this is the insert location
-            if (start < LPC_CANAF_RAM->mask[index]) {
-                break;
-            }
-        }
+    int FilterTransaction::stage(FilterSection section, bool remove, uint32_t first, uint32_t last) {
+        //Make sure we have room to stage another operation
+        if (operationCount >= CANFILTER_TRANSACTION_DEPTH)
+            return -1;
 
-        //Have to set the AFMR to modify mode
-        LPC_CANAF->AFMR = 1;
+        FilterOperation & operation = operations[operationCount];
+        operation.first = first;
+        operation.last = last;
+        operation.section = static_cast<uint8_t>(section);
+        operation.remove = remove;
+        operation.order = operationCount;
+        operationCount++;
 
-        //Make space for two new masks
-        upShiftFilter(index);
-        upShiftFilter(index + 1);
+        return 0;
+    }
 
-        //Insert new mask start
-        LPC_CANAF_RAM->mask[index] = start;
-        //Insert new mask end
-        LPC_CANAF_RAM->mask[index + 1] = end;
+    int FilterTransaction::commit(bool optimize) {
+        CANFILTER_MEASURE(lpc, commit);
 
-        extGrpCANCount++;
-        calculateAddresses();
+        unsigned short counts[4];
+        unsigned short words;
+        unsigned short missing;
+
+        if (lpc.buildTable(operations, operationCount, optimize, 0, counts, words, missing) != 0)
+            return -1;
+
+        lpc.writeTable(lpc.tableImage, words, counts);
+        clear();
 
         return 0;
     }
 
-    int updateStandardFilter(CANController SCC, uint32_t mask) {
-        //Sanitize inputs
-        sanitizeStdMask(SCC, mask);
+    int FilterTransaction::beginCommit(bool optimize) {
+        CANFILTER_MEASURE(lpc, commit);
+
+        unsigned short counts[4];
+        unsigned short words;
+        unsigned short missing;
+
+        //The table is built from the live one, so it has to be whole
+        lpc.cancelCommit();
+
+        if (lpc.buildTable(operations, operationCount, optimize, 0, counts, words, missing) != 0)
+            return -1;
+
+        lpc.beginCommit(words, counts);
+        clear();
 
         return 0;
     }
-    int updateStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Sanitize inputs
-        sanitizeStdMask(SCC, start);
-        sanitizeStdMask(SCC, end);
+
+    void FilterTransaction::clear() {
+        operationCount = 0;
+    }
+
+    unsigned short FilterTransaction::size() const {
+        return operationCount;
+    }
+
+    SoftwareFilter::SoftwareFilter() {
+        clear();
+    }
+
+    int SoftwareFilter::insertStandardFilter(CANController SCC, uint32_t mask) {
+        return insertStandardGroupFilter(SCC, mask, mask);
+    }
+    int SoftwareFilter::insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        //Only have 11 bits for the mask, remove any possible extra
+        start &= 0x000007FF;
+        end &= 0x000007FF;
+
+        for (uint32_t id = start; id <= end; id++) {
+            standard[static_cast<int>(SCC)][id / 8] |= (1 << (id % 8));
+        }
 
         return 0;
     }
-    int updateExtendedFilter(CANController SCC, uint32_t mask) {
-        //Sanitize inputs
+    int SoftwareFilter::insertExtendedFilter(CANController SCC, uint32_t mask) {
         sanitizeExtMask(SCC, mask);
+        return insertExtended(mask, mask);
+    }
+    int SoftwareFilter::insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        sanitizeExtMask(SCC, start);
+        sanitizeExtMask(SCC, end);
+        return insertExtended(start, end);
+    }
 
-        return 0;
+    int SoftwareFilter::deleteStandardFilter(CANController SCC, uint32_t mask) {
+        return deleteStandardGroupFilter(SCC, mask, mask);
     }
-    int updateExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Sanitize inputs
+    int SoftwareFilter::deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        //Only have 11 bits for the mask, remove any possible extra
+        start &= 0x000007FF;
+        end &= 0x000007FF;
+
+        bool found = false;
+        for (uint32_t id = start; id <= end; id++) {
+            uint8_t & bits = standard[static_cast<int>(SCC)][id / 8];
+            if (bits & (1 << (id % 8)))
+                found = true;
+            bits &= ~(1 << (id % 8));
+        }
+
+        return found ? 0 : -2;
+    }
+    int SoftwareFilter::deleteExtendedFilter(CANController SCC, uint32_t mask) {
+        sanitizeExtMask(SCC, mask);
+        return deleteExtended(mask, mask);
+    }
+    int SoftwareFilter::deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
         sanitizeExtMask(SCC, start);
         sanitizeExtMask(SCC, end);
+        return deleteExtended(start, end);
+    }
 
-        return 0;
+    void SoftwareFilter::clear() {
+        for (int c = 0; c < 2; c++) {
+            for (int i = 0; i < 256; i++) {
+                standard[c][i] = 0;
+            }
+            extendedCovered[c] = false;
+        }
+        extendedCount = 0;
     }
 
-    int deleteStandardFilter(CANController SCC, uint32_t mask) {
-        //Make sure the table isn't empty
-        if(LPC_CANAF->ENDofTable == 0)
-            return -1;
+    int SoftwareFilter::insertExtended(uint32_t first, uint32_t last) {
+        //Find the first range that ends at or after the id before first, on
+        //the same controller
+        unsigned short index = 0;
+        while (index < extendedCount && extended[index].last < first
+               && ((extended[index].last >> 29) != (first >> 29) || first - extended[index].last > 1))
+            index++;
+
+        //Swallow every range that overlaps or touches the new one, as long as
+        //it is on the same controller
+        unsigned short end = index;
+        while (end < extendedCount && (extended[end].first >> 29) == (first >> 29)
+               && (extended[end].first <= last || extended[end].first - last == 1)) {
+            if (extended[end].first < first)
+                first = extended[end].first;
+            if (extended[end].last > last)
+                last = extended[end].last;
+            end++;
+        }
 
-        //Sanitize inputs
-        sanitizeStdMask(SCC, mask);
+        if (end == index) {
+            //Nothing to merge with, make room for a new range
+            if (extendedCount >= CANFILTER_SOFTWARE_RANGES)
+                return -1;
+            for (unsigned short i = extendedCount; i > index; i--) {
+                extended[i] = extended[i - 1];
+            }
+            extendedCount++;
+        } else {
+            //Close the gap left by the swallowed ranges
+            unsigned short removed = end - index - 1;
+            for (unsigned short i = index + 1; i + removed < extendedCount; i++) {
+                extended[i] = extended[i + removed];
+            }
+            extendedCount -= removed;
+        }
 
-        //Index of the delete location.
-        unsigned short index;
+        extended[index].first = first;
+        extended[index].last = last;
 
-        //Start at the beginning of all standard items. End at the start of the
-        //extended filter.
-        for (index = (LPC_CANAF->SFF_sa / 4); index < (LPC_CANAF->SFF_GRP_sa / 4); index++) {
-            //Check if this is the delete location
-            if (mask == (LPC_CANAF_RAM->mask[index] >> 16)) { //Equal to the MSB
-                break;
-            } else if (mask == (LPC_CANAF_RAM->mask[index] & 0x0000FFFF)) { //Equal to the LSB
-                //Modify the filter, so that the item to be deleted is in the MSB
-                LPC_CANAF->AFMR = 1;
-                LPC_CANAF_RAM->mask[index] = (LPC_CANAF_RAM->mask[index] << 16) | (LPC_CANAF_RAM->mask[index] >> 16);
+        return 0;
+    }
+
+    int SoftwareFilter::deleteExtended(uint32_t first, uint32_t last) {
+        bool found = false;
+
+        unsigned short index = 0;
+        while (index < extendedCount) {
+            Range & range = extended[index];
+            if (range.last < first || range.first > last) {
+                index++;
+                continue;
+            }
+            found = true;
+
+            if (range.first < first && range.last > last) {
+                //Deleting the middle of the range, split it in two
+                if (extendedCount >= CANFILTER_SOFTWARE_RANGES)
+                    return -1;
+                for (unsigned short i = extendedCount; i > index + 1; i--) {
+                    extended[i] = extended[i - 1];
+                }
+                extendedCount++;
+                extended[index + 1].first = last + 1;
+                extended[index + 1].last = range.last;
+                range.last = first - 1;
                 break;
+            } else if (range.first < first) {
+                range.last = first - 1;
+                index++;
+            } else if (range.last > last) {
+                range.first = last + 1;
+                index++;
+            } else {
+                //The whole range goes
+                for (unsigned short i = index; i + 1 < extendedCount; i++) {
+                    extended[i] = extended[i + 1];
+                }
+                extendedCount--;
             }
         }
 
-        //If the item is not found, don't delete anything
-        if (index >= (LPC_CANAF->SFF_GRP_sa / 4)) {
-            return -2;
+        return found ? 0 : -2;
+    }
+
+    int SoftwareFilter::place(TrafficRate rate, bool merge, uint32_t threshold,
+                              unsigned short counts[4], unsigned short & words, bool covered[2]) {
+        covered[0] = false;
+        covered[1] = false;
+
+        //Standard ids, walking the runs of set bits for each controller
+        LPC1768Filter::RangeCoalescer standardRanges(lpc, false, 0);
+        for (int c = 0; c < 2 && !standardRanges.full; c++) {
+            FilterEntry range = { 0, 0 };
+            bool open = false;
+            uint32_t id = 0;
+
+            while (id < 2048) {
+                if ((standard[c][id / 8] & (1 << (id % 8))) == 0) {
+                    id++;
+                    continue;
+                }
+
+                FilterEntry run;
+                run.first = id;
+                while (id < 2048 && (standard[c][id / 8] & (1 << (id % 8))))
+                    id++;
+                run.last = id - 1;
+
+                if (open && merge) {
+                    uint32_t gapFirst = range.last + 1;
+                    uint32_t gapLast = run.first - 1;
+                    uint32_t cost = rate ? rate(static_cast<CANController>(c), gapFirst, gapLast, false)
+                                         : gapLast - gapFirst + 1;
+                    if (cost <= threshold) {
+                        range.last = run.last;
+                        continue;
+                    }
+                }
+
+                if (open) {
+                    FilterEntry entry = { range.first | (c << 13), range.last | (c << 13) };
+                    standardRanges.add(entry);
+                }
+                range = run;
+                open = true;
+            }
+
+            if (open) {
+                FilterEntry entry = { range.first | (c << 13), range.last | (c << 13) };
+                standardRanges.add(entry);
+            }
         }
 
-        LPC_CANAF->AFMR = 1;
+        unsigned short base = standardRanges.finish();
+        if (standardRanges.full)
+            return -1;
 
-        downShiftFilterStd(index);
+        //Extended ranges are already sorted, with the controller first
+        LPC1768Filter::RangeCoalescer extendedRanges(lpc, true, base);
+        FilterEntry range = { 0, 0 };
+        bool open = false;
+        for (unsigned short i = 0; i < extendedCount && !extendedRanges.full; i++) {
+            FilterEntry next = { extended[i].first, extended[i].last };
+
+            if (open && merge && (range.first >> 29) == (next.first >> 29)) {
+                uint32_t gapFirst = (range.last + 1) & 0x1FFFFFFF;
+                uint32_t gapLast = (next.first - 1) & 0x1FFFFFFF;
+                uint32_t cost = rate ? rate(static_cast<CANController>(next.first >> 29), gapFirst, gapLast, true)
+                                     : gapLast - gapFirst + 1;
+                if (cost <= threshold) {
+                    range.last = next.last;
+                    covered[next.first >> 29] = true;
+                    continue;
+                }
+            }
 
-        //If we had an odd number of items, we can shrink the standard filter area
-        if (stdCANCount % 2) {
-            //Shift into the final standard filter address
-            downShiftFilter((LPC_CANAF->SFF_GRP_sa / 4) - 1);
+            if (open)
+                extendedRanges.add(range);
+            range = next;
+            open = true;
         }
+        if (open)
+            extendedRanges.add(range);
 
-        stdCANCount--;
-        calculateAddresses();
+        base += extendedRanges.finish();
+        if (extendedRanges.full)
+            return -1;
+
+        counts[0] = standardRanges.ids;
+        counts[1] = standardRanges.groups;
+        counts[2] = extendedRanges.ids;
+        counts[3] = extendedRanges.groups;
+        words = base;
 
         return 0;
     }
-    int deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Make sure the table isn't empty
-        if(LPC_CANAF->ENDofTable == 0)
-            return -1;
 
-        //Sanitize inputs
-        sanitizeStdMask(SCC, start);
-        sanitizeStdMask(SCC, end);
+    int SoftwareFilter::commit(TrafficRate rate) {
+        CANFILTER_MEASURE(lpc, commit);
+
+        unsigned short counts[4];
+        unsigned short words;
+        bool covered[2];
+
+        //Try the exact whitelist first
+        if (place(rate, false, 0, counts, words, covered) != 0) {
+            //Find the lowest traffic threshold that makes the table fit
+            uint32_t low = 0;
+            uint32_t high = 0xFFFFFFFF;
+
+            if (place(rate, true, high, counts, words, covered) != 0)
+                return -1;
+
+            while (low < high) {
+                uint32_t middle = low + ((high - low) / 2);
+                if (place(rate, true, middle, counts, words, covered) == 0) {
+                    high = middle;
+                } else {
+                    low = middle + 1;
+                }
+            }
 
-        //Put the items into one int
-        uint32_t mask = (start << 16) & end;
+            place(rate, true, high, counts, words, covered);
+        }
 
-        //Index of the delete location.
-        unsigned short index;
-        //Start at the beginning of all standard group items. End at the start of the
-        //extended filter.
-        for (index = (LPC_CANAF->SFF_GRP_sa / 4); index < (LPC_CANAF->EFF_sa / 4); index++) {
-            //Check if this is the delete location
-            if (mask == LPC_CANAF_RAM->mask[index]) {
-                break;
+        lpc.writeTable(lpc.tableImage, words, counts);
+        extendedCovered[0] = covered[0];
+        extendedCovered[1] = covered[1];
+
+        return 0;
+    }
+
+    bool SoftwareFilter::accept(CANController SCC, uint32_t id, bool extended) const {
+        int c = static_cast<int>(SCC);
+
+        if (!extended) {
+            id &= 0x000007FF;
+            return (standard[c][id / 8] & (1 << (id % 8))) != 0;
+        }
+
+        //The hardware only passes whitelisted ids on this controller
+        if (!extendedCovered[c])
+            return true;
+
+        sanitizeExtMask(SCC, id);
+
+        //Find the last range starting at or before the id
+        int low = 0;
+        int high = extendedCount - 1;
+        while (low <= high) {
+            int middle = (low + high) / 2;
+            if (this->extended[middle].first <= id) {
+                if (id <= this->extended[middle].last)
+                    return true;
+                low = middle + 1;
+            } else {
+                high = middle - 1;
             }
         }
 
-        //If the item is not found, don't delete anything
-        if (index >= (LPC_CANAF->EFF_sa / 4)) {
-            return -2;
+        return false;
+    }
+
+    namespace
+    {
+        //One odd multiplier per row of the sketch
+        const uint32_t sketchSeeds[4] = { 0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F };
+
+        /**
+         * Counter of a sanitized id in one row of a TrafficMonitor sketch.
+         * Standard and extended ids hash differently, since their sanitized
+         * values overlap.
+         */
+        unsigned sketchColumn(uint32_t key, bool extended, int row) {
+            uint32_t mixed = (key ^ (extended ? 0x5BD1E995 : 0)) * sketchSeeds[row];
+            return (mixed >> 16) & (CANFILTER_SKETCH_WIDTH - 1);
         }
 
-        LPC_CANAF->AFMR = 1;
+        /**
+         * Masks the CAN interrupt, which TrafficMonitor::sample() runs from,
+         * while the counts are read or rewritten from a thread. Restores the
+         * interrupt only if it was enabled. Nothing to mask on the host.
+         */
+        class SampleLock {
+        public:
+            SampleLock() {
+#ifndef CANFILTER_SIM
+                enabled = NVIC_GetEnableIRQ(CAN_IRQn) != 0;
+                NVIC_DisableIRQ(CAN_IRQn);
+#endif
+            }
+
+            ~SampleLock() {
+#ifndef CANFILTER_SIM
+                if (enabled)
+                    NVIC_EnableIRQ(CAN_IRQn);
+#endif
+            }
 
-        downShiftFilter(index);
+        private:
+            SampleLock(const SampleLock &);
+            SampleLock & operator=(const SampleLock &);
 
-        stdGrpCANCount--;
-        calculateAddresses();
+#ifndef CANFILTER_SIM
+            bool enabled;
+#endif
+        };
 
-        return 0;
+        /**
+         * Stage the insert of one piece of a split group, as a single filter
+         * if it is one id wide.
+         */
+        int stagePiece(FilterTransaction & transaction, CANController SCC, bool extended, uint32_t first, uint32_t last) {
+            if (extended) {
+                return (first == last) ? transaction.insertExtendedFilter(SCC, first)
+                                       : transaction.insertExtendedGroupFilter(SCC, first, last);
+            }
+            return (first == last) ? transaction.insertStandardFilter(SCC, first)
+                                   : transaction.insertStandardGroupFilter(SCC, first, last);
+        }
     }
-    int deleteExtendedFilter(CANController SCC, uint32_t mask) {
-        //Make sure the table isn't empty
-        if(LPC_CANAF->ENDofTable == 0)
-            return -1;
 
-        //Sanitize inputs
-        sanitizeExtMask(SCC, mask);
+    static_assert((CANFILTER_SKETCH_WIDTH & (CANFILTER_SKETCH_WIDTH - 1)) == 0,
+                  "CANFILTER_SKETCH_WIDTH must be a power of two");
 
-        //Index of the delete location.
-        unsigned short index;
-        //Start at the beginning of all extended items. End at the start of the
-        //extended group filter.
-        for (index = (LPC_CANAF->EFF_sa / 4); index < (LPC_CANAF->EFF_GRP_sa / 4); index++) {
-            //Check if this is the delete location
-            if (mask == LPC_CANAF_RAM->mask[index]) {
-                break;
+    TrafficMonitor::TrafficMonitor() {
+        clear();
+    }
+
+    void TrafficMonitor::sample(CANController SCC, uint32_t id, bool extended) {
+        uint32_t key = id;
+        if (extended) {
+            sanitizeExtMask(SCC, key);
+        } else {
+            sanitizeStdMask(SCC, key);
+        }
+
+        //The estimate is the smallest of the counters the id hashes to
+        uint16_t count = 0xFFFF;
+        for (int row = 0; row < 4; row++) {
+            uint16_t & counter = sketch[row][sketchColumn(key, extended, row)];
+            if (counter < 0xFFFF)
+                counter++;
+            if (counter < count)
+                count = counter;
+        }
+        samples++;
+
+        //Keep the busiest ids as candidates, replacing the quietest one
+        Candidate * quietest = &candidates[0];
+        for (unsigned short i = 0; i < CANFILTER_MONITOR_CANDIDATES; i++) {
+            Candidate & candidate = candidates[i];
+            if (candidate.count > 0 && candidate.key == key && candidate.extended == extended) {
+                candidate.count = count;
+                return;
             }
+            if (candidate.count < quietest->count)
+                quietest = &candidate;
+        }
+        if (count > quietest->count) {
+            quietest->key = key;
+            quietest->count = count;
+            quietest->extended = extended;
         }
+    }
 
-        //If the item is not found, don't delete anything
-        if (index >= (LPC_CANAF->EFF_GRP_sa / 4)) {
-            return -2;
+    uint32_t TrafficMonitor::estimate(CANController SCC, uint32_t id, bool extended) const {
+        uint32_t key = id;
+        if (extended) {
+            sanitizeExtMask(SCC, key);
+        } else {
+            sanitizeStdMask(SCC, key);
         }
 
-        LPC_CANAF->AFMR = 1;
+        uint16_t count = 0xFFFF;
+        for (int row = 0; row < 4; row++) {
+            count = std::min(count, sketch[row][sketchColumn(key, extended, row)]);
+        }
+        return count;
+    }
 
-        downShiftFilter(index);
+    uint32_t TrafficMonitor::total() const {
+        return samples;
+    }
 
-        extCANCount--;
-        calculateAddresses();
+    int TrafficMonitor::propose(FilterTransaction & transaction, uint32_t threshold) {
+        //The busy candidates in table order, so the ones in the same group
+        //come together
+        Candidate busy[CANFILTER_MONITOR_CANDIDATES];
+        unsigned short busyCount = 0;
+        //Copied with the receive interrupt masked, so sample() can't swap a
+        //candidate out halfway through
+        {
+            SampleLock lock;
+            for (unsigned short i = 0; i < CANFILTER_MONITOR_CANDIDATES; i++) {
+                Candidate candidate = candidates[i];
+                if (candidate.count == 0 || candidate.count < threshold)
+                    continue;
+
+                //Insertion sort, standard ids first
+                unsigned short position = busyCount++;
+                while (position > 0 && (busy[position - 1].extended > candidate.extended
+                                        || (busy[position - 1].extended == candidate.extended
+                                            && busy[position - 1].key > candidate.key))) {
+                    busy[position] = busy[position - 1];
+                    position--;
+                }
+                busy[position] = candidate;
+            }
+        }
 
-        return 0;
-    }
-    int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
-        //Make sure the table isn't empty
-        if(LPC_CANAF->ENDofTable == 0)
-            return -1;
+        int freeWords = LPC1768Filter::capacity - lpc.tableEnd - lpc.objectWords();
+        int carved = 0;
+        unsigned short i = 0;
 
-        //Sanitize inputs
-        sanitizeExtMask(SCC, start);
-        sanitizeExtMask(SCC, end);
+        while (i < busyCount) {
+            bool extended = busy[i].extended;
+            FilterSection single = extended ? FilterSection::extended : FilterSection::standard;
+            FilterSection section = extended ? FilterSection::extendedGroup : FilterSection::standardGroup;
+            uint32_t id = extended ? 0x1FFFFFFF : 0x000007FF;
 
-        //Index of the delete location.
-        unsigned short index;
-        //Start at the beginning of all extended group items. End at the start of the
-        //extended group filter.
-        for (index = (LPC_CANAF->EFF_GRP_sa / 4); index < (LPC_CANAF->ENDofTable / 4); index += 2) {
-            //Check if this is the delete location
-            if (start == LPC_CANAF_RAM->mask[index]
-                && end == LPC_CANAF_RAM->mask[index+1]) {
+            int group = lpc.findGroup(section, busy[i].key);
+            if (group < 0) {
+                i++;
+                continue;
+            }
+            FilterEntry range = entryKey(section, lpc.readEntry(section, group));
+            CANController SCC = static_cast<CANController>(entryController(section, range));
+
+            //Split the group around every busy id it holds, except the ones
+            //that have a filter of their own anyway
+            uint32_t pieces[CANFILTER_MONITOR_CANDIDATES + 1][2];
+            unsigned short pieceCount = 0;
+            uint32_t next = range.first;
+            int ids = 0;
+            for (; i < busyCount && busy[i].extended == extended && busy[i].key <= range.last; i++) {
+                uint32_t key = busy[i].key;
+                if (lpc.findEntry(single, { key, key }) >= 0)
+                    continue;
+                if (key > next) {
+                    pieces[pieceCount][0] = next;
+                    pieces[pieceCount][1] = key - 1;
+                    pieceCount++;
+                }
+                next = key + 1;
+                ids++;
+            }
+            if (ids == 0)
+                continue;
+            if (next <= range.last) {
+                pieces[pieceCount][0] = next;
+                pieces[pieceCount][1] = range.last;
+                pieceCount++;
+            }
+
+            //Words the split adds, counting a standard id as a whole word
+            int words = -static_cast<int>(sectionWords(section, 1));
+            for (unsigned short p = 0; p < pieceCount; p++) {
+                words += sectionWords(pieces[p][0] == pieces[p][1] ? single : section, 1);
+            }
+            if (words > freeWords)
                 break;
+            freeWords -= words;
+
+            int result = extended ? transaction.deleteExtendedGroupFilter(SCC, range.first & id, range.last & id)
+                                  : transaction.deleteStandardGroupFilter(SCC, range.first & id, range.last & id);
+            for (unsigned short p = 0; result == 0 && p < pieceCount; p++) {
+                result = stagePiece(transaction, SCC, extended, pieces[p][0] & id, pieces[p][1] & id);
             }
-        }
+            if (result != 0)
+                return -1;
 
-        //If the item is not found, don't delete anything
-        if (index >= (LPC_CANAF->ENDofTable / 4)) {
-            return -2;
+            carved += ids;
         }
 
-        LPC_CANAF->AFMR = 1;
+        return carved;
+    }
 
-        //Delete both items
-        downShiftFilter(index);
-        downShiftFilter(index);
+    int TrafficMonitor::adapt(FilterTransaction & transaction, uint32_t budget, uint32_t threshold) {
+        if (samples <= budget)
+            return 0;
 
-        extGrpCANCount--;
-        calculateAddresses();
+        transaction.clear();
 
-        return 0;
+        int carved = propose(transaction, threshold);
+        if (carved > 0 && transaction.commit(false) != 0)
+            carved = -1;
+        transaction.clear();
+
+        //The carved ids won't be seen again, start over
+        if (carved > 0) {
+            clear();
+        } else {
+            decay();
+        }
+
+        return carved;
+    }
+
+    void TrafficMonitor::decay() {
+        SampleLock lock;
+        for (int row = 0; row < 4; row++) {
+            for (unsigned short i = 0; i < CANFILTER_SKETCH_WIDTH; i++) {
+                sketch[row][i] /= 2;
+            }
+        }
+        for (unsigned short i = 0; i < CANFILTER_MONITOR_CANDIDATES; i++) {
+            candidates[i].count /= 2;
+        }
+        samples = 0;
+    }
+
+    void TrafficMonitor::clear() {
+        SampleLock lock;
+        for (int row = 0; row < 4; row++) {
+            for (unsigned short i = 0; i < CANFILTER_SKETCH_WIDTH; i++) {
+                sketch[row][i] = 0;
+            }
+        }
+        for (unsigned short i = 0; i < CANFILTER_MONITOR_CANDIDATES; i++) {
+            candidates[i].count = 0;
+        }
+        samples = 0;
     }
 }
@@ -1,7 +1,99 @@
 #ifndef CANFILTER_H
 #define CANFILTER_H
 
+#ifdef CANFILTER_SIM
+//Host build, use the simulated acceptance filter instead of the LPC1768
+#include "CANFilterSim.h"
+#else
 #include "mbed.h"
+#endif
+
+#include <atomic>
+
+//Filter snapshots need the flash programming interface
+#if defined(CANFILTER_SIM) || defined(DEVICE_FLASH)
+#define CANFILTER_SNAPSHOTS 1
+#endif
+
+/**
+ * Maximum number of inserts and deletes a FilterTransaction can stage before
+ * it has to be committed. Each staged operation costs 12 bytes of SRAM.
+ */
+#ifndef CANFILTER_TRANSACTION_DEPTH
+#define CANFILTER_TRANSACTION_DEPTH 256
+#endif
+
+/**
+ * Maximum number of extended ranges a SoftwareFilter can hold. Each range
+ * costs 8 bytes of SRAM.
+ */
+#ifndef CANFILTER_SOFTWARE_RANGES
+#define CANFILTER_SOFTWARE_RANGES 256
+#endif
+
+/**
+ * Maximum number of handlers that can be registered for dispatch().
+ */
+#ifndef CANFILTER_MAX_HANDLERS
+#define CANFILTER_MAX_HANDLERS 32
+#endif
+
+/**
+ * Maximum number of filters that can be disabled at once. Each costs 20
+ * bytes of SRAM.
+ */
+#ifndef CANFILTER_MAX_DISABLED
+#define CANFILTER_MAX_DISABLED 64
+#endif
+
+/**
+ * Maximum number of filters a FilterSet can hold. Each filter costs 12 bytes
+ * of SRAM.
+ */
+#ifndef CANFILTER_SET_SIZE
+#define CANFILTER_SET_SIZE 256
+#endif
+
+/**
+ * Number of commands a FilterQueue can hold before posting fails. Must be a
+ * power of two. Each command costs 48 bytes of SRAM.
+ */
+#ifndef CANFILTER_QUEUE_DEPTH
+#define CANFILTER_QUEUE_DEPTH 32
+#endif
+
+/**
+ * Counters in each of the 4 rows of a TrafficMonitor's count-min sketch. Must
+ * be a power of two. Each costs 8 bytes of SRAM.
+ */
+#ifndef CANFILTER_SKETCH_WIDTH
+#define CANFILTER_SKETCH_WIDTH 128
+#endif
+
+/**
+ * Number of times readFullCANObject() reads a message object the hardware is
+ * storing a frame in before it gives up.
+ */
+#ifndef CANFILTER_FULLCAN_RETRIES
+#define CANFILTER_FULLCAN_RETRIES 16
+#endif
+
+/**
+ * Number of high rate ids a TrafficMonitor keeps as candidates for carving
+ * out of groups. Each costs 8 bytes of SRAM.
+ */
+#ifndef CANFILTER_MONITOR_CANDIDATES
+#define CANFILTER_MONITOR_CANDIDATES 16
+#endif
+
+/**
+ * Flash address saveFilterSnapshot() and loadFilterSnapshot() use by default,
+ * the start of the last 32KB sector of the LPC1768. The application must not
+ * be linked into it.
+ */
+#ifndef CANFILTER_SNAPSHOT_ADDRESS
+#define CANFILTER_SNAPSHOT_ADDRESS 0x78000
+#endif
 
 namespace CANFilter {
     /**
@@ -12,10 +104,12 @@ namespace CANFilter {
      *  during a running system. All messages accepted.
      * operating - Will filter messages to only accept messages in the Look-Up
      *  Table RAM.
+     * FullCAN mode is set apart with enableFullCAN(), and kept over every
+     * change of mode.
      */
     enum struct FilterMode {
-        off         = 0b10, //2 = 0b10
-        bypass      = 0b01, //1 = 0b01
+        off         = 0b01, //1 = 0b01, AccOff
+        bypass      = 0b10, //2 = 0b10, AccBP
         operating   = 0b00  //0 = 0b00
     };
 
@@ -29,11 +123,76 @@ namespace CANFilter {
         CAN2 = 0b001
     };
 
+    /**
+     * The sections of the Look-Up Table, in the order they are laid out in the
+     * acceptance filter RAM.
+     */
+    enum struct FilterSection {
+        standard        = 0,
+        standardGroup   = 1,
+        extended        = 2,
+        extendedGroup   = 3
+    };
+
     /**
      * Set the AFMR register to one of the filtering modes.
      */
     void setFilterMode(FilterMode mode);
 
+    /**
+     * Keep the Look-Up Table in one half of the acceptance filter RAM and build
+     * every change in the other half while the old table keeps filtering. The
+     * filter then only goes into bypass to swap the section registers over,
+     * instead of for the whole shift. Tables larger than half the RAM are
+     * still changed in place.
+     * @param enable True to turn double buffering on
+     */
+    void setDoubleBuffering(bool enable);
+
+    /**
+     * Called by dispatch() for a frame that matched a filter.
+     * @param frame Whatever was passed to dispatch(), typically the CANMessage
+     */
+    typedef void (*FilterHandler)(void * frame);
+
+    /**
+     * Register a handler for a filter id. Frames accepted by a table entry for
+     * that id are passed to it by dispatch().
+     * @param SCC Which CAN controller the filter is on
+     * @param mask The filter id to handle
+     * @param extended True for 29-bit ids, false for 11-bit ids
+     * @param handler The function to call
+     * @return 0 on success, -1 if CANFILTER_MAX_HANDLERS are registered
+     */
+    int registerHandler(CANController SCC, uint32_t mask, bool extended, FilterHandler handler);
+    /**
+     * Register a handler for a range of filter ids. Frames accepted by any
+     * table entry, single or group, that lies inside the range are passed to
+     * it by dispatch(). If ranges overlap, the last one registered wins.
+     * @param SCC Which CAN controller the filters are on
+     * @param start The first filter id to handle
+     * @param end The last filter id to handle
+     * @param extended True for 29-bit ids, false for 11-bit ids
+     * @param handler The function to call
+     * @return 0 on success, -1 if CANFILTER_MAX_HANDLERS are registered
+     */
+    int registerHandler(CANController SCC, uint32_t start, uint32_t end, bool extended, FilterHandler handler);
+
+    /**
+     * Remove every registered handler.
+     */
+    void clearHandlers();
+
+    /**
+     * Call the handler of the table entry a frame matched, with one array
+     * lookup. The entry is given by the ID Index field of the CANxRFS register
+     * (bits 0-9), which must be read before the frame is released.
+     * @param index The ID Index the acceptance filter reported
+     * @param frame Passed on to the handler
+     * @return true if a handler was called
+     */
+    bool dispatch(unsigned short index, void * frame);
+
     /**
      * Reset the filter. Allow all messages to come in, delete old filters.
      */
@@ -69,33 +228,105 @@ namespace CANFilter {
     int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
 
     /**
-     * Update a standard filter to the CAN acceptance filter. Will trigger the
-     * use of the acceptance filter.
+     * Insert every id that matches (id & mask) == code to the CAN acceptance
+     * filter. The ids are split into the fewest single ids and groups that
+     * cover them, and merged into the table in one pass. Bits of the code
+     * outside of the mask are ignored. Will trigger the use of the acceptance
+     * filter.
      * @param SCC Which CAN controller will be affected by this filter
-     * @param mask The filter id that will be updated
+     * @param code The bits the id must have where the mask is set
+     * @param mask Which bits of the id are compared
+     * @param extended True for 29-bit ids, false for 11-bit ids
+     * @return 0 on success, -1 if the table is full
      */
-    int updateStandardFilter(CANController SCC, uint32_t mask);
+    int insertMaskFilter(CANController SCC, uint32_t code, uint32_t mask, bool extended);
     /**
-     * Update a standard group filter to the CAN acceptance filter. Will trigger
-     * the use of the acceptance filter.
+     * How many words of the Look-Up Table a mask filter takes up on its own.
+     * @param code The bits the id must have where the mask is set
+     * @param mask Which bits of the id are compared
+     * @param extended True for 29-bit ids, false for 11-bit ids
+     */
+    int maskFilterWords(uint32_t code, uint32_t mask, bool extended);
+
+    /**
+     * Replace the Look-Up Table with a prebuilt image, copying it to the
+     * acceptance filter RAM in one pass. Images are normally built at compile
+     * time with makeStaticTable() from CANFilterStatic.h, which also has an
+     * overload of this function taking the whole table.
+     * @param words The table image, sorted and packed in hardware order
+     * @param size Number of words in the image
+     * @param counts Number of items in each FilterSection of the image
+     * @return 0 on success, -1 if the image is larger than the RAM left by
+     *  the FullCAN section
+     */
+    int loadStaticTable(const uint32_t * words, unsigned short size, const unsigned short counts[4]);
+
+#ifdef CANFILTER_SNAPSHOTS
+    /**
+     * Save the Look-Up Table to a flash sector, so it can be restored at boot
+     * without rebuilding it. The snapshot holds the packed table, without
+     * disabled filters or FullCAN ids, its section counts, a format version
+     * and a CRC.
+     * Handlers are not saved, register them again after loading.
+     * @param address Start of a flash sector reserved for the snapshot. It
+     *  is erased.
+     * @return 0 on success, -1 if the flash could not be written
+     */
+    int saveFilterSnapshot(uint32_t address = CANFILTER_SNAPSHOT_ADDRESS);
+
+    /**
+     * Replace the Look-Up Table with a snapshot saved by saveFilterSnapshot().
+     * The snapshot is checked, then copied to the acceptance filter RAM in
+     * one pass.
+     * @param address Where the snapshot was saved
+     * @return 0 on success, -1 if the flash could not be read, -2 if there is
+     *  no valid snapshot there. The acceptance filter is left untouched on
+     *  failure.
+     */
+    int loadFilterSnapshot(uint32_t address = CANFILTER_SNAPSHOT_ADDRESS);
+#endif
+
+    /**
+     * Change a standard filter of the CAN acceptance filter to another id. The
+     * filter is rewritten where it is and moved only past the filters between
+     * its old and new places. Will trigger the use of the acceptance filter.
      * @param SCC Which CAN controller will be affected by this filter
-     * @param mask The filter id that will be updated
+     * @param oldMask The filter id that will be updated
+     * @param newMask The filter id it will be updated to
+     * @return 0 on success, -2 if the old filter was not found
      */
-    int updateStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+    int updateStandardFilter(CANController SCC, uint32_t oldMask, uint32_t newMask);
     /**
-     * Update a extended filter to the CAN acceptance filter. Will trigger the
-     * use of the acceptance filter.
+     * Change a standard group filter of the CAN acceptance filter to another
+     * range. Will trigger the use of the acceptance filter.
      * @param SCC Which CAN controller will be affected by this filter
-     * @param mask The filter id that will be updated
+     * @param oldStart The first filter id of the group that will be updated
+     * @param oldEnd The last filter id of the group that will be updated
+     * @param newStart The first filter id of the updated group
+     * @param newEnd The last filter id of the updated group
+     * @return 0 on success, -2 if the old filter was not found
      */
-    int updateExtendedFilter(CANController SCC, uint32_t mask);
+    int updateStandardGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd);
     /**
-     * Update a extended group filter to the CAN acceptance filter. Will trigger
-     * the use of the acceptance filter.
+     * Change a extended filter of the CAN acceptance filter to another id.
+     * Will trigger the use of the acceptance filter.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param oldMask The filter id that will be updated
+     * @param newMask The filter id it will be updated to
+     * @return 0 on success, -2 if the old filter was not found
+     */
+    int updateExtendedFilter(CANController SCC, uint32_t oldMask, uint32_t newMask);
+    /**
+     * Change a extended group filter of the CAN acceptance filter to another
+     * range. Will trigger the use of the acceptance filter.
      * @param SCC Which CAN controller will be affected by this filter
-     * @param mask The filter id that will be updated
+     * @param oldStart The first filter id of the group that will be updated
+     * @param oldEnd The last filter id of the group that will be updated
+     * @param newStart The first filter id of the updated group
+     * @param newEnd The last filter id of the updated group
+     * @return 0 on success, -2 if the old filter was not found
      */
-    int updateExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+    int updateExtendedGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd);
 
     /**
      * Delete a standard filter from the CAN acceptance filter. Will trigger the
@@ -125,5 +356,904 @@ namespace CANFilter {
      * @param mask The filter id that will be deleted
      */
     int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+
+    /**
+     * Disable a filter in place, without shifting the table. Standard filters
+     * have their disable bit set with one word write, which doesn't need
+     * bypass. Extended filters have no disable bit, so the entry is
+     * overwritten with a copy of its neighbour in a short bypass window.
+     * Disabled filters keep their place until the table needs the space.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param section Which section of the table the filter is in
+     * @param start The filter id, or the first filter id of a group
+     * @param end The last filter id of a group
+     * @return 0 on success, -1 if CANFILTER_MAX_DISABLED filters are already
+     *  disabled, -2 if the filter was not found
+     */
+    int disableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end);
+    int disableFilter(CANController SCC, FilterSection section, uint32_t mask);
+    /**
+     * Disable a set of filters of one section in one bypass window.
+     * @param masks The filter ids, or start and end pairs for groups
+     * @param count Number of filters
+     * @return 0 on success, or the first error of disableFilter()
+     */
+    int disableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count);
+
+    /**
+     * Enable a filter disabled with disableFilter(). If it was compacted out
+     * of the table it is inserted again.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param section Which section of the table the filter is in
+     * @param start The filter id, or the first filter id of a group
+     * @param end The last filter id of a group
+     * @return 0 on success, -1 if the table is full and the filter stays
+     *  disabled, -2 if the filter was not disabled
+     */
+    int enableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end);
+    int enableFilter(CANController SCC, FilterSection section, uint32_t mask);
+    /**
+     * Enable a set of filters of one section, sharing one bypass window.
+     * @param masks The filter ids, or start and end pairs for groups
+     * @param count Number of filters
+     * @return 0 on success, or the first error of enableFilter()
+     */
+    int enableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count);
+
+    /**
+     * Rebuild the table without the disabled filters. Inserts do this on
+     * their own when the table is full. Any other rebuild of the table, such
+     * as a FilterTransaction commit, also drops them.
+     * @return 0 on success, -1 if the table could not be rebuilt
+     */
+    int compactFilters();
+
+    /**
+     * A frame the acceptance filter stored in the message object of a FullCAN
+     * id, read with readFullCANObject().
+     */
+    struct FullCANObject {
+        uint32_t id;            //11 bit identifier
+        CANController SCC;      //Controller the frame arrived on
+        uint8_t length;         //Data length code
+        bool remote;            //Remote transmission request
+        uint8_t data[8];
+    };
+
+    /**
+     * Turn FullCAN mode on or off. In FullCAN mode, standard frames with an id
+     * inserted by insertFullCANFilter() are stored by the acceptance filter in
+     * a message object of their own, without interrupting the CPU. The
+     * FullCAN ids are kept in front of the standard section, and the message
+     * objects after the end of the table, so both come out of the 512 words
+     * of the RAM. Double buffering is not used in FullCAN mode, since the
+     * FullCAN section has to start the RAM. Turning it off drops the FullCAN
+     * ids, and so does resetFilter().
+     * @param enable True to turn FullCAN mode on
+     */
+    void enableFullCAN(bool enable = true);
+
+    /**
+     * Give a standard id a FullCAN message object. The id takes half a word
+     * and the object 3 words. Frames with the id no longer reach the receive
+     * interrupt, read them with readFullCANObject() instead.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param mask The filter id that will be stored
+     * @return 0 on success, -1 if FullCAN mode is off or the RAM is full
+     */
+    int insertFullCANFilter(CANController SCC, uint32_t mask);
+    /**
+     * Take an id out of the FullCAN section, along with its message object.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param mask The filter id that will be deleted
+     * @return 0 on success, -2 if the id has no message object
+     */
+    int deleteFullCANFilter(CANController SCC, uint32_t mask);
+
+    /**
+     * Find the message object of a FullCAN id. Objects are kept in id order,
+     * so inserting or deleting an id moves the objects of the ids above it.
+     * @param SCC Which CAN controller the filter is on
+     * @param mask The filter id
+     * @return Index of the message object, or -2 if the id has none
+     */
+    int fullCANIndex(CANController SCC, uint32_t mask);
+
+    /**
+     * Copy the latest frame of a message object from the acceptance filter
+     * RAM into object. The frame doesn't go through a receive buffer, but it
+     * is copied, so object stays valid after the hardware stores the next
+     * one. Uses the semaphore bits of the object, so a frame the hardware
+     * stores while it is being read is read over instead of coming back
+     * torn, up to CANFILTER_FULLCAN_RETRIES times. Only one thread or
+     * interrupt should read each object.
+     * @param index Index of the message object, from fullCANIndex()
+     * @param object Filled in with the frame
+     * @return 0 if a new frame was read, -1 if there is no such object, -2
+     *  if no frame arrived since the last read, or the hardware kept storing
+     *  frames through every retry. object is only filled in on 0.
+     */
+    int readFullCANObject(unsigned short index, FullCANObject & object);
+
+    /**
+     * Compare the copy of the Look-Up Table the driver keeps in SRAM with the
+     * acceptance filter RAM and the section registers. Every search is done
+     * on that copy, and the peripheral is only written, so this is the one
+     * place it is read back, for self tests and debug builds.
+     * @return How many words and registers differ, 0 if they all match
+     */
+    int verifyMirror();
+
+    /**
+     * Check if the acceptance filter lets a frame through, searching the
+     * table the way the hardware does: FullCAN ids, then single ids, then
+     * groups. Each section is binary searched in the SRAM copy of the table,
+     * so this is O(log n) and never touches the peripheral. Groups are found
+     * by the last one starting at or below the id, so overlapping groups
+     * should be merged with commit(true).
+     * @param SCC Which CAN controller the frame arrives on
+     * @param id The 11 or 29 bit identifier of the frame
+     * @param extended If the frame has an extended identifier
+     * @return true if the frame is accepted. Every frame is in bypass, and
+     *  none in off mode.
+     */
+    bool isAccepted(CANController SCC, uint32_t id, bool extended);
+
+    /**
+     * @return How many items are in a section of the Look-Up Table, including
+     *  disabled filters and placeholders
+     */
+    unsigned short count(FilterSection section);
+
+    /**
+     * A filter of the Look-Up Table, decoded from the packed entry it is
+     * stored as.
+     */
+    struct FilterView {
+        CANController SCC;      //Controller the filter is for
+        uint32_t start;         //The id, or the first id of a group
+        uint32_t end;           //The same as start, or the last id of a group
+        bool active;            //False if disabled, or holding the place of a
+                                //disabled extended filter
+    };
+
+    namespace detail {
+        struct DisabledFilter;
+    }
+
+    /**
+     * Walks the items of one section of the Look-Up Table, decoding each one
+     * from the SRAM copy of the table as it is read. Nothing is copied.
+     */
+    class FilterIterator {
+    public:
+        FilterIterator(FilterSection section, const uint32_t * words, unsigned short count, unsigned short index,
+                       const detail::DisabledFilter * disabled, unsigned short disabledCount);
+
+        FilterView operator*() const;
+        FilterIterator & operator++();
+        bool operator==(const FilterIterator & other) const;
+        bool operator!=(const FilterIterator & other) const;
+
+    private:
+        FilterSection section;
+        const uint32_t * words;     //First word of the section
+        unsigned short count;       //Items in the section
+        unsigned short index;       //Item of the section
+        //Records of the filters disabled in place, to tell their
+        //placeholders from the filters they copy
+        const detail::DisabledFilter * disabled;
+        unsigned short disabledCount;
+    };
+
+    /**
+     * The items of one section of the Look-Up Table, for a range-based for:
+     *
+     *     for (CANFilter::FilterView filter : CANFilter::sectionFilters(CANFilter::FilterSection::extended))
+     *         printf("%08X\n", filter.start);
+     *
+     * Any change to the table makes it stale.
+     */
+    class FilterRange {
+    public:
+        FilterRange(FilterSection section, const uint32_t * words, unsigned short count,
+                    const detail::DisabledFilter * disabled, unsigned short disabledCount);
+
+        FilterIterator begin() const;
+        FilterIterator end() const;
+        unsigned short size() const;
+
+    private:
+        FilterSection section;
+        const uint32_t * words;
+        unsigned short count;
+        const detail::DisabledFilter * disabled;
+        unsigned short disabledCount;
+    };
+
+    /**
+     * @return The items of a section of the Look-Up Table, in the order the
+     *  hardware sorts them
+     */
+    FilterRange sectionFilters(FilterSection section);
+
+    /**
+     * A single insert or delete staged by a FilterTransaction. Masks are stored
+     * sanitized, so they compare the same way the acceptance filter sorts them.
+     */
+    struct FilterOperation {
+        uint32_t first;         //The mask, or the start of a group
+        uint32_t last;          //Same as first, or the end of a group
+        uint8_t section;        //FilterSection the operation belongs to
+        bool remove;            //Delete instead of insert
+        unsigned short order;   //When it was staged, so the last one wins
+    };
+
+    /**
+     * Stages inserts and deletes in SRAM, then writes the whole Look-Up Table
+     * in a single bypass window when committed. Use this instead of the
+     * insert/delete functions above when loading many filters at once, since
+     * each of those shifts the table and toggles the AFMR on every call.
+     *
+     * Operations on the same filter are applied in the order they were staged,
+     * so the last one wins. Deleting a filter that is not in the table is
+     * ignored.
+     */
+    class FilterTransaction {
+    public:
+        FilterTransaction();
+
+        /**
+         * Stage a standard filter to be inserted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be whitelisted
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int insertStandardFilter(CANController SCC, uint32_t mask);
+        /**
+         * Stage a standard group filter to be inserted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+        /**
+         * Stage a extended filter to be inserted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be whitelisted
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int insertExtendedFilter(CANController SCC, uint32_t mask);
+        /**
+         * Stage a extended group filter to be inserted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+
+        /**
+         * Stage every id that matches (id & mask) == code to be inserted, as
+         * the fewest single ids and groups that cover them.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param code The bits the id must have where the mask is set
+         * @param mask Which bits of the id are compared
+         * @param extended True for 29-bit ids, false for 11-bit ids
+         * @return 0 on success, -1 if the transaction can't hold every entry
+         */
+        int insertMaskFilter(CANController SCC, uint32_t code, uint32_t mask, bool extended);
+
+        /**
+         * Stage a standard filter to be deleted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be deleted
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int deleteStandardFilter(CANController SCC, uint32_t mask);
+        /**
+         * Stage a standard group filter to be deleted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+        /**
+         * Stage a extended filter to be deleted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be deleted
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int deleteExtendedFilter(CANController SCC, uint32_t mask);
+        /**
+         * Stage a extended group filter to be deleted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the transaction is full
+         */
+        int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+
+        /**
+         * Merge the staged operations with the current Look-Up Table and write
+         * the result to the acceptance filter in one bypass window. The staged
+         * operations are cleared afterwards.
+         *
+         * When optimizing, duplicate ids are dropped, ids already covered by a
+         * group are dropped, overlapping or adjacent ids and groups on the same
+         * controller are merged into one range, and each range is stored in
+         * whichever form takes the fewest words. A run of three or more ids
+         * becomes a group, and a group of one or two ids becomes single ids.
+         * Filters that were merged can no longer be deleted on their own.
+         * @param optimize True to shrink the table before writing it
+         * @return 0 on success, -1 if the resulting table would not fit. The
+         *  acceptance filter is left untouched on failure.
+         */
+        int commit(bool optimize = false);
+
+        /**
+         * Merge the staged operations with the current Look-Up Table like
+         * commit(), but only build the new table in SRAM. commitStep() then
+         * writes it a few words at a time, so no call blocks for long. The
+         * staged operations are cleared afterwards, and a commit that is
+         * still pending is dropped first.
+         * @param optimize True to shrink the table before writing it
+         * @return 0 on success, -1 if the resulting table would not fit. The
+         *  acceptance filter is left untouched on failure.
+         */
+        int beginCommit(bool optimize = false);
+
+        /**
+         * Drop all staged operations without touching the acceptance filter.
+         */
+        void clear();
+
+        /**
+         * @return How many operations are currently staged
+         */
+        unsigned short size() const;
+
+    private:
+        int stage(FilterSection section, bool remove, uint32_t first, uint32_t last);
+
+        FilterOperation operations[CANFILTER_TRANSACTION_DEPTH];
+        unsigned short operationCount;
+    };
+
+    /**
+     * How far the commit started by FilterTransaction::beginCommit() has got,
+     * from getCommitProgress().
+     */
+    struct CommitProgress {
+        bool pending;               //A commit is waiting for more steps
+        bool inPlace;               //Written over the live table in one step
+        unsigned short words;       //Words of acceptance filter RAM the commit writes
+        unsigned short wordsLeft;   //Words still to write
+    };
+
+    /**
+     * Write the next part of the commit started by beginCommit(), at most
+     * budget words of acceptance filter RAM. Each word costs the same, so the
+     * budget bounds how long a step takes; time one with CANFILTER_STATS.
+     *
+     * The new table is written to RAM the live table doesn't use, while the
+     * filter keeps working in operating mode, and the step after the last
+     * word points the section registers at it in one short bypass window.
+     * A table that can't fit next to the live one, or any table in FullCAN
+     * mode, can't be written without taking the filter out of operating
+     * mode. It is written over the live table in a single step instead, in
+     * one bypass window like commit(), whatever the budget.
+     *
+     * Until this returns 0, only commitStep(), cancelCommit() and
+     * getCommitProgress() should be called.
+     * @param budget Most words to write in this step, at least 1
+     * @return 1 if more steps are needed, 0 once the new table is in use or
+     *  if no commit is pending, -2 if the table was changed by another call
+     *  and the commit was dropped
+     */
+    int commitStep(unsigned short budget);
+
+    /**
+     * Drop the pending commit. The live table is never touched before the
+     * last step.
+     */
+    void cancelCommit();
+
+    /**
+     * Read how far the pending commit has got, so a scheduler can spread the
+     * steps over idle time.
+     */
+    void getCommitProgress(CommitProgress & progress);
+
+    /**
+     * Rate of frames seen on the bus for a range of ids, in any unit, used by
+     * SoftwareFilter to decide which gaps between filters are cheapest to let
+     * through the hardware.
+     * @param SCC Which CAN controller the frames arrived on
+     * @param start The first id of the range
+     * @param end The last id of the range
+     * @param extended True for 29-bit ids, false for 11-bit ids
+     */
+    typedef uint32_t (*TrafficRate)(CANController SCC, uint32_t start, uint32_t end, bool extended);
+
+    /**
+     * A whitelist that can be larger than the Look-Up Table. The whole list is
+     * kept in SRAM, as a bitmap for standard ids and a sorted array of ranges
+     * for extended ids. When committed, as much of it as possible goes into the
+     * hardware exactly. If it doesn't fit, the gaps between neighbouring
+     * filters are merged into wider hardware ranges, cheapest first, until it
+     * does. Frames in a merged gap get through the hardware, so the RX path
+     * must check every frame with accept().
+     *
+     * The filter owns the whole Look-Up Table while it is in use. Committing
+     * replaces anything added through the other functions.
+     */
+    class SoftwareFilter {
+    public:
+        SoftwareFilter();
+
+        /**
+         * Add a standard filter to the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be whitelisted
+         */
+        int insertStandardFilter(CANController SCC, uint32_t mask);
+        /**
+         * Add a standard group filter to the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         */
+        int insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+        /**
+         * Add a extended filter to the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be whitelisted
+         * @return 0 on success, -1 if there is no room for another range
+         */
+        int insertExtendedFilter(CANController SCC, uint32_t mask);
+        /**
+         * Add a extended group filter to the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if there is no room for another range
+         */
+        int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+
+        /**
+         * Remove a standard filter from the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be deleted
+         * @return 0 on success, -2 if the id was not whitelisted
+         */
+        int deleteStandardFilter(CANController SCC, uint32_t mask);
+        /**
+         * Remove a standard group filter from the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -2 if none of the ids were whitelisted
+         */
+        int deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+        /**
+         * Remove a extended filter from the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param mask The filter id that will be deleted
+         * @return 0 on success, -1 if splitting a range needs more room, -2 if
+         *  the id was not whitelisted
+         */
+        int deleteExtendedFilter(CANController SCC, uint32_t mask);
+        /**
+         * Remove a extended group filter from the whitelist.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if splitting a range needs more room, -2 if
+         *  none of the ids were whitelisted
+         */
+        int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end);
+
+        /**
+         * Remove everything from the whitelist.
+         */
+        void clear();
+
+        /**
+         * Write the whitelist to the acceptance filter, merging the gaps with
+         * the least traffic first if it doesn't fit.
+         * @param rate Traffic seen in a range of ids. Without it, the smallest
+         *  gaps are merged first.
+         * @return 0 on success, -1 if the table would not fit
+         */
+        int commit(TrafficRate rate = 0);
+
+        /**
+         * Check a received frame against the whitelist. Standard ids are one
+         * bit test. Extended ids are only searched, in O(log n), on controllers
+         * that had gaps merged in the hardware.
+         * @param SCC Which CAN controller the frame arrived on
+         * @param id The 11 or 29 bit identifier of the frame
+         * @param extended If the frame has an extended identifier
+         * @return true if the frame is on the whitelist
+         */
+        bool accept(CANController SCC, uint32_t id, bool extended) const;
+
+    private:
+        /**
+         * A range of extended ids, sanitized so the controller bits sort first.
+         */
+        struct Range {
+            uint32_t first;
+            uint32_t last;
+        };
+
+        int insertExtended(uint32_t first, uint32_t last);
+        int deleteExtended(uint32_t first, uint32_t last);
+        int place(TrafficRate rate, bool merge, uint32_t threshold,
+                  unsigned short counts[4], unsigned short & words, bool covered[2]);
+
+        uint8_t standard[2][256];       //One bit per standard id, per controller
+        Range extended[CANFILTER_SOFTWARE_RANGES];
+        unsigned short extendedCount;
+        bool extendedCovered[2];        //If the hardware lets extra ids through
+    };
+
+    /**
+     * Finds the ids that group filters let through but nothing handles, and
+     * carves the busiest ones out of their groups. Feed it from the receive
+     * path with every frame that was accepted but not handled:
+     *
+     *     if (!CANFilter::dispatch(index, &msg))
+     *         monitor.sample(SCC, msg.id, msg.format == CANExtended);
+     *
+     * and call adapt() from a thread once per period. Rates are kept in a
+     * count-min sketch, so the memory used doesn't depend on how many ids
+     * the bus carries. The busiest ids are tracked as candidates.
+     *
+     * sample() is meant for the CAN receive interrupt. The other functions
+     * that read or rewrite the counts run from a thread and mask CAN_IRQn
+     * while they do, so a monitor must only be sampled from that interrupt
+     * or from the thread that adapts it.
+     */
+    class TrafficMonitor {
+    public:
+        TrafficMonitor();
+
+        /**
+         * Count one unhandled frame. O(1), meant for the CAN receive
+         * interrupt.
+         * @param SCC Which CAN controller the frame arrived on
+         * @param id The 11 or 29 bit identifier of the frame
+         * @param extended If the frame has an extended identifier
+         */
+        void sample(CANController SCC, uint32_t id, bool extended);
+
+        /**
+         * @return Frames of an id counted this period. Never less than the
+         *  real count, may be more.
+         */
+        uint32_t estimate(CANController SCC, uint32_t id, bool extended) const;
+
+        /**
+         * @return Unhandled frames counted this period
+         */
+        uint32_t total() const;
+
+        /**
+         * Stage the changes that carve every candidate id counted at least
+         * threshold times out of the group filter that accepts it, as long as
+         * the table stays within 512 words. Ids with a filter of their own are
+         * left alone. Nothing is written until the transaction is committed.
+         * CAN_IRQn is masked while the candidates are read.
+         * @return How many ids were carved out, or -1 if the transaction
+         *  filled up
+         */
+        int propose(FilterTransaction & transaction, uint32_t threshold);
+
+        /**
+         * If more than budget unhandled frames were counted this period,
+         * carve out the candidates counted at least threshold times in one
+         * table rewrite, and start a new period.
+         * @param transaction Where the changes are staged. Cleared before
+         *  and after, so it can be kept and reused across periods.
+         * @return How many ids were carved out, 0 if under budget, or -1 if
+         *  the changes would not fit
+         */
+        int adapt(FilterTransaction & transaction, uint32_t budget, uint32_t threshold);
+
+        /**
+         * Halve every count, so old traffic fades out. Call once per period.
+         * CAN_IRQn is masked while the counts are rewritten.
+         */
+        void decay();
+
+        /**
+         * Forget everything counted. CAN_IRQn is masked while the counts
+         * are rewritten.
+         */
+        void clear();
+
+    private:
+        /**
+         * A busy id, sanitized like a table entry.
+         */
+        struct Candidate {
+            uint32_t key;
+            uint16_t count;
+            bool extended;
+        };
+
+        uint16_t sketch[4][CANFILTER_SKETCH_WIDTH];
+        Candidate candidates[CANFILTER_MONITOR_CANDIDATES];
+        uint32_t samples;
+    };
+
+    class FilterSet;
+
+    /**
+     * Make the filters of one controller exactly a set, leaving the other
+     * controller alone. The set is compared with the live table first, and
+     * if anything differs the new table is merged and written in one bypass
+     * window. Disabled filters of the controller are dropped.
+     * @param SCC Which CAN controller the set is for
+     * @param set The filters the controller should have. It is sorted, and
+     *  duplicates removed, in place.
+     * @return How many filters were inserted or deleted, or -1 if the table
+     *  would not fit. The acceptance filter is left untouched on failure.
+     */
+    int applyFilterSet(CANController SCC, FilterSet & set);
+
+    /**
+     * Delete every filter of one controller, such as after a bus fault, in one
+     * pass over the table and one bypass window. The other controller's
+     * filters are left alone. Disabled filters of the controller are dropped.
+     * @param SCC Which CAN controller to clear
+     * @return How many table items were deleted
+     */
+    int clearController(CANController SCC);
+
+    /**
+     * Replace every filter of one controller with a set. Same as
+     * applyFilterSet().
+     */
+    int replaceController(CANController SCC, FilterSet & set);
+
+    /**
+     * Give one controller the same filters as another, in one pass over the
+     * table and one bypass window. The target's own filters, including
+     * disabled ones, are dropped. Disabled filters of the source are not
+     * copied.
+     * @param from The controller whose filters are copied
+     * @param to The controller that gets them
+     * @return 0 on success, -1 if the table would not fit. The acceptance
+     *  filter is left untouched on failure.
+     */
+    int copyController(CANController from, CANController to);
+
+    /**
+     * The complete list of filters one controller should have, for
+     * applyFilterSet(). Filters are added without a controller.
+     *
+     *     CANFilter::FilterSet set;
+     *     set.insertStandardFilter(0x100);
+     *     set.insertExtendedGroupFilter(0x18FF0000, 0x18FFFFFF);
+     *     CANFilter::applyFilterSet(CANFilter::CANController::CAN1, set);
+     */
+    class FilterSet {
+    public:
+        FilterSet();
+
+        /**
+         * Add a standard filter to the set.
+         * @param mask The filter id that will be whitelisted
+         * @return 0 on success, -1 if the set is full
+         */
+        int insertStandardFilter(uint32_t mask);
+        /**
+         * Add a standard group filter to the set.
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the set is full
+         */
+        int insertStandardGroupFilter(uint32_t start, uint32_t end);
+        /**
+         * Add a extended filter to the set.
+         * @param mask The filter id that will be whitelisted
+         * @return 0 on success, -1 if the set is full
+         */
+        int insertExtendedFilter(uint32_t mask);
+        /**
+         * Add a extended group filter to the set.
+         * @param start The first filter id of the group
+         * @param end The last filter id of the group
+         * @return 0 on success, -1 if the set is full
+         */
+        int insertExtendedGroupFilter(uint32_t start, uint32_t end);
+
+        /**
+         * Remove every filter from the set.
+         */
+        void clear();
+
+        /**
+         * @return How many filters are in the set
+         */
+        unsigned short size() const;
+
+    private:
+        template <class Backend, unsigned short Capacity>
+        friend class BasicCANFilter;
+
+        int add(FilterSection section, uint32_t first, uint32_t last);
+
+        FilterOperation entries[CANFILTER_SET_SIZE];
+        unsigned short entryCount;
+    };
+
+#ifdef CANFILTER_STATS
+    /**
+     * Work done by one kind of operation since the statistics were reset.
+     * Cycles are DWT cycles on the target and nanoseconds on the host.
+     */
+    struct OperationStats {
+        unsigned long count;        //Calls made
+        unsigned long ramReads;     //Words read back from the acceptance filter RAM,
+                                    //which only FullCAN objects need
+        unsigned long ramWrites;    //Words of acceptance filter RAM written
+        unsigned long cycles;       //Total time taken
+        unsigned long maxCycles;    //Longest single call
+    };
+
+    /**
+     * Snapshot of the acceptance filter, from getStats().
+     */
+    struct FilterStats {
+        unsigned short sectionWords[4];     //Words used by each FilterSection
+        unsigned short freeWords;           //Words left in the acceptance filter RAM
+        unsigned short wastedHalfWords;     //Held by padding, disabled filters
+                                            //and placeholders, freed by compactFilters()
+        unsigned long bypassWindows;        //Times the filter left operating mode
+        unsigned long bypassCycles;         //Total time out of operating mode
+        unsigned long maxBypassCycles;      //Longest time out of operating mode
+        OperationStats insert;              //insert* functions
+        OperationStats remove;              //delete* functions
+        OperationStats update;              //update* functions
+        OperationStats toggle;              //enable* and disable* functions
+        OperationStats commit;              //Everything that rewrites the whole table,
+                                            //including compactions an insert triggers
+        OperationStats step;                //commitStep() calls
+        unsigned long lookupErrors;         //LUTerr seen by getStats()
+        uint32_t lastErrorAddress;          //LUTerrAd of the last one
+    };
+
+    /**
+     * Read the occupancy of the Look-Up Table and the counters collected since
+     * the last resetStats(). Only built when CANFILTER_STATS is defined, so
+     * release builds pay nothing for it.
+     */
+    void getStats(FilterStats & stats);
+
+    /**
+     * Clear the counters and start the cycle counter. resetFilter() starts it
+     * too.
+     */
+    void resetStats();
+#endif
+
+    /**
+     * Identifies a command posted to a FilterQueue. 0 means the queue was
+     * full and the command was not posted. Tickets wrap around after 2^32
+     * posts, skipping 0.
+     */
+    typedef uint32_t FilterTicket;
+
+    /**
+     * Called by FilterQueue::process() after each batch of commands has been
+     * written to the acceptance filter.
+     * @param last Ticket of the last command in the batch. Every command up to
+     *  it is done.
+     * @param result 0 on success, -1 if the batch would not fit in the table
+     */
+    typedef void (*FilterQueueNotify)(FilterTicket last, int result);
+
+    /**
+     * Lets several threads, and interrupt handlers, change the filters without
+     * locking. Posting a command is O(1), never blocks and is safe from an
+     * ISR. A single worker, usually a low priority thread, calls process() to
+     * drain the queue and write every queued command to the acceptance filter
+     * in one table rewrite.
+     *
+     * While a queue is in use, only its worker should change the filters.
+     * None of the other functions are synchronized.
+     */
+    class FilterQueue {
+    public:
+        FilterQueue();
+
+        /**
+         * Queue a filter to be inserted.
+         * @param SCC Which CAN controller will be affected by this filter
+         * @param section Which section of the table the filter goes in
+         * @param start The filter id, or the first filter id of a group
+         * @param end The last filter id of a group
+         * @return Ticket of the command, or 0 if the queue is full
+         */
+        FilterTicket postInsert(CANController SCC, FilterSection section, uint32_t start, uint32_t end);
+        FilterTicket postInsert(CANController SCC, FilterSection section, uint32_t mask);
+        /**
+         * Queue a filter to be deleted. Deleting a filter that is not in the
+         * table is ignored.
+         * @return Ticket of the command, or 0 if the queue is full
+         */
+        FilterTicket postDelete(CANController SCC, FilterSection section, uint32_t start, uint32_t end);
+        FilterTicket postDelete(CANController SCC, FilterSection section, uint32_t mask);
+        /**
+         * Queue a filter to be changed to another id or range. Like the
+         * update functions, nothing changes if the old filter is not in the
+         * table, or put there by an earlier command.
+         * @return Ticket of the command, or 0 if the queue is full
+         */
+        FilterTicket postUpdate(CANController SCC, FilterSection section, uint32_t oldStart, uint32_t oldEnd,
+                                uint32_t newStart, uint32_t newEnd);
+
+        /**
+         * Drain every command posted so far and write them to the acceptance
+         * filter in one bypass window. Only one thread may call this.
+         * @return 0 on success or if there was nothing to do, -1 if the batch
+         *  would not fit in the table, which drops it
+         */
+        int process();
+
+        /**
+         * @return If the command with this ticket has been written. Commands
+         *  of a batch that was dropped are never done, at least until
+         *  another batch is dropped; the notify function sees every result.
+         */
+        bool done(FilterTicket ticket) const;
+
+        /**
+         * Set the function called after each batch, such as one that sets an
+         * rtos::EventFlags the posting threads wait on.
+         */
+        void setNotify(FilterQueueNotify notify);
+
+    private:
+        /**
+         * A queued insert, delete or update, sanitized.
+         */
+        struct Command {
+            uint32_t first;
+            uint32_t last;
+            uint32_t newFirst;      //Updates only
+            uint32_t newLast;
+            uint8_t section;
+            uint8_t kind;
+        };
+
+        /**
+         * A place in the ring. sequence says whose turn it is: producers may
+         * fill it when it equals their position, and the worker may read it
+         * once it is one past.
+         */
+        struct Slot {
+            std::atomic<uint32_t> sequence;
+            Command command;
+        };
+
+        FilterTicket post(const Command & command);
+
+        Slot slots[CANFILTER_QUEUE_DEPTH];
+        std::atomic<uint32_t> tail;         //Next position to post to
+        uint32_t head;                      //Next position to drain, worker only
+        std::atomic<uint32_t> completed;        //Last ticket written or dropped
+        std::atomic<uint32_t> droppedBatches;   //Batches dropped so far
+        std::atomic<uint32_t> droppedFirst[2];  //Tickets of the last dropped batch,
+        std::atomic<uint32_t> droppedLast[2];   //at droppedBatches % 2
+        FilterQueueNotify notify;
+        FilterOperation operations[CANFILTER_QUEUE_DEPTH * 2];
+    };
 }
 #endif
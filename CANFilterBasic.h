@@ -0,0 +1,3109 @@
+#ifndef CANFILTERBASIC_H
+#define CANFILTERBASIC_H
+
+#include "CANFilter.h"
+
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(CANFILTER_STATS) && defined(CANFILTER_SIM)
+#include <chrono>
+#endif
+
+/**
+ * The filter driver as a class, for a second acceptance filter or another
+ * part with the same one. The free functions in CANFilter.h work on an
+ * LPC1768Filter of their own, so most programs never need this header.
+ *
+ *     struct LPC4088AcceptanceFilter : CANFilter::LPCAcceptanceFilter {};
+ *     CANFilter::BasicCANFilter<LPC4088AcceptanceFilter, 512> filter;
+ *
+ *     filter.resetFilter();
+ *     filter.insertStandardFilter(CANFilter::CANController::CAN1, 0x100);
+ *
+ * The backend is a struct of static functions that reach the registers and
+ * RAM, so they compile to the same direct stores as before and nothing is
+ * virtual. The size of the RAM is a template parameter, checked when the
+ * class is instantiated.
+ */
+namespace CANFilter {
+    /**
+     * Backend for the acceptance filter of the LPC17xx and LPC40xx, through
+     * LPC_CANAF and LPC_CANAF_RAM. With CANFILTER_SIM those are the simulated
+     * acceptance filter.
+     *
+     * A backend for other hardware needs the same members.
+     */
+    struct LPCAcceptanceFilter {
+        //CAN controllers sharing the filter, numbered from 0 like CANController
+        static const unsigned controllers = 2;
+
+        static uint32_t readRam(unsigned short index) {
+            return LPC_CANAF_RAM->mask[index];
+        }
+
+        static void writeRam(unsigned short index, uint32_t data) {
+            LPC_CANAF_RAM->mask[index] = data;
+        }
+
+        /**
+         * Write the section registers, in bytes, in the order they are laid
+         * out.
+         */
+        static void writeSections(uint32_t standard, uint32_t standardGroup, uint32_t extended, uint32_t extendedGroup,
+                                  uint32_t end) {
+            //Beginning of the Standard (11-bit) CAN message filter
+            LPC_CANAF->SFF_sa       = standard;
+            //Beginning of the Standard (11-bit) Group CAN message filter
+            LPC_CANAF->SFF_GRP_sa   = standardGroup;
+            //Beginning of the Extended (29-bit) CAN message filter
+            LPC_CANAF->EFF_sa       = extended;
+            //Beginning of the Extended (29-bit) Group CAN message filter
+            LPC_CANAF->EFF_GRP_sa   = extendedGroup;
+            //End of the acceptance filter
+            LPC_CANAF->ENDofTable   = end;
+        }
+
+        /**
+         * Read the section registers back, for verifyMirror().
+         */
+        static void readSections(uint32_t sections[5]) {
+            sections[0] = LPC_CANAF->SFF_sa;
+            sections[1] = LPC_CANAF->SFF_GRP_sa;
+            sections[2] = LPC_CANAF->EFF_sa;
+            sections[3] = LPC_CANAF->EFF_GRP_sa;
+            sections[4] = LPC_CANAF->ENDofTable;
+        }
+
+        static void writeMode(uint32_t mode) {
+            LPC_CANAF->AFMR = mode;
+        }
+
+        static uint32_t readMode() {
+            return LPC_CANAF->AFMR;
+        }
+
+        /**
+         * @param address Set to the address of the error, if there was one.
+         *  Reading it clears the error.
+         * @return If a lookup error was flagged
+         */
+        static bool lookupError(uint32_t & address) {
+            if (!LPC_CANAF->LUTerr)
+                return false;
+            address = LPC_CANAF->LUTerrAd;
+            return true;
+        }
+    };
+
+    namespace detail {
+#ifdef CANFILTER_STATS
+        /**
+         * Turn on the DWT cycle counter. Nothing to do on the host.
+         */
+        inline void startCycleCounter() {
+#ifndef CANFILTER_SIM
+            CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+            DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+        }
+
+        /**
+         * Cycles on the target, nanoseconds on the host. Only differences are
+         * used, so wrapping around is fine.
+         */
+        inline uint32_t cycleCount() {
+#ifdef CANFILTER_SIM
+            return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#else
+            return DWT->CYCCNT;
+#endif
+        }
+
+        /**
+         * Adds the RAM accesses and time of one call of a public function to
+         * its OperationStats when it goes out of scope.
+         */
+        class StatsScope {
+        public:
+            StatsScope(OperationStats & op, const unsigned long & ramReads, const unsigned long & ramWrites)
+                : operation(op), readCount(ramReads), writeCount(ramWrites), reads(ramReads), writes(ramWrites),
+                  start(cycleCount()) {}
+
+            ~StatsScope() {
+                uint32_t cycles = cycleCount() - start;
+                operation.count++;
+                operation.ramReads += readCount - reads;
+                operation.ramWrites += writeCount - writes;
+                operation.cycles += cycles;
+                if (cycles > operation.maxCycles)
+                    operation.maxCycles = cycles;
+            }
+
+        private:
+            OperationStats & operation;
+            const unsigned long & readCount;
+            const unsigned long & writeCount;
+            unsigned long reads;
+            unsigned long writes;
+            uint32_t start;
+        };
+#endif
+
+        //Standard filters are packed two to a word. An odd count leaves the LSB
+        //of the last word unused, so fill it with a disabled entry that sorts
+        //after everything else.
+        const uint32_t stdPadding = 0x0000FFFF;
+
+        /**
+         * Sanitize the standard filters being input, so that any extra bits are removed
+         * and the controller bits are placed correctly.
+         */
+        inline void sanitizeStdMask(CANController SCC, uint32_t & mask) {
+            //Only have 11 bits for the mask, remove any possible extra
+            mask &= 0x000007FF;
+            //The controller bits begin at bit 13
+            mask |= (static_cast<int>(SCC) << 13);
+        }
+
+        /**
+         * Sanitize the extended filters being input, so that any extra bits are removed
+         * and the controller bits are placed correctly.
+         */
+        inline void sanitizeExtMask(CANController SCC, uint32_t & mask) {
+            //Only have 29 bits for the mask, remove any possible extra
+            mask &= 0x1FFFFFFF;
+            //The controller bits begin at bit 29
+            mask |= (static_cast<int>(SCC) << 29);
+        }
+
+        /**
+         * A decoded Look-Up Table entry. Single ids have first == last.
+         */
+        struct FilterEntry {
+            uint32_t first;
+            uint32_t last;
+        };
+
+        inline bool operator<(const FilterEntry & a, const FilterEntry & b) {
+            return a.first < b.first || (a.first == b.first && a.last < b.last);
+        }
+
+        inline bool operator==(const FilterEntry & a, const FilterEntry & b) {
+            return a.first == b.first && a.last == b.last;
+        }
+
+        /**
+         * A filter that was disabled in place. Extended filters are replaced
+         * by a copy of a neighbour, the placeholder, so they can be found
+         * again. Once the table is rebuilt the entry is gone from it, and
+         * enabling the filter inserts it again.
+         */
+        struct DisabledFilter {
+            FilterEntry entry;
+            FilterEntry placeholder;
+            uint8_t section;
+            bool placed;            //Still holds a place in the table
+        };
+
+        /**
+         * How many words a section with count items takes up.
+         */
+        inline unsigned short sectionWords(FilterSection section, unsigned short count) {
+            switch (section) {
+                case FilterSection::standard:       return (count + 1) / 2;
+                case FilterSection::extendedGroup:  return count * 2;
+                default:                            return count;
+            }
+        }
+
+        //Standard entries have a disable bit next to the controller bits
+        const uint32_t stdDisable = 0x00001000;
+
+        //Extended entries have no disable bit. A disabled extended filter that
+        //has no neighbour to copy is moved onto this controller, which doesn't
+        //exist on the LPC1768.
+        const uint32_t placeholderController = 0b111;
+
+        /**
+         * The part of an entry the hardware sorts and compares on, without the
+         * disable bits of standard entries.
+         */
+        inline FilterEntry entryKey(FilterSection section, const FilterEntry & entry) {
+            if (section == FilterSection::standard || section == FilterSection::standardGroup)
+                return { entry.first & ~stdDisable, entry.last & ~stdDisable };
+            return entry;
+        }
+
+        /**
+         * If an entry read from the table has been disabled, and doesn't take
+         * part in filtering.
+         */
+        inline bool isDisabled(FilterSection section, const FilterEntry & entry) {
+            if (section == FilterSection::standard || section == FilterSection::standardGroup)
+                return ((entry.first | entry.last) & stdDisable) != 0;
+            return (entry.first >> 29) == placeholderController;
+        }
+
+        /**
+         * The controller bits of a sanitized entry.
+         */
+        inline unsigned entryController(FilterSection section, const FilterEntry & entry) {
+            if (section == FilterSection::standard || section == FilterSection::standardGroup)
+                return (entry.first >> 13) & 0x7;
+            return entry.first >> 29;
+        }
+
+        /**
+         * Sanitize a filter id, or range of ids, for a section.
+         */
+        inline FilterEntry sanitizeEntry(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+            if (section == FilterSection::standard || section == FilterSection::standardGroup) {
+                sanitizeStdMask(SCC, start);
+                sanitizeStdMask(SCC, end);
+            } else {
+                sanitizeExtMask(SCC, start);
+                sanitizeExtMask(SCC, end);
+            }
+
+            return { start, end };
+        }
+
+        /**
+         * Decode item index of a section from the words the section starts
+         * at.
+         */
+        inline FilterEntry decodeEntry(FilterSection section, const uint32_t * words, unsigned short index) {
+            FilterEntry entry;
+
+            switch (section) {
+                case FilterSection::standard:
+                    //Even items are in the MSB, odd items in the LSB
+                    entry.first = (index % 2 == 0) ? (words[index / 2] >> 16) : (words[index / 2] & 0x0000FFFF);
+                    entry.last = entry.first;
+                    break;
+                case FilterSection::standardGroup:
+                    entry.first = words[index] >> 16;
+                    entry.last = words[index] & 0x0000FFFF;
+                    break;
+                case FilterSection::extended:
+                    entry.first = words[index];
+                    entry.last = entry.first;
+                    break;
+                default:
+                    entry.first = words[index * 2];
+                    entry.last = words[(index * 2) + 1];
+                    break;
+            }
+
+            return entry;
+        }
+
+        /**
+         * Splits a mask filter, (id & mask) == code, into the blocks of ids it
+         * accepts, in ascending order. The free bits below the lowest mask bit
+         * make each block contiguous, and every combination of the free bits
+         * above it starts a new block. Blocks never touch, so this is also the
+         * fewest ranges that cover the filter.
+         */
+        struct MaskBlocks {
+            bool extended;
+            uint32_t base;      //Fixed bits of every id, with the controller bits
+            uint32_t free;      //Free bits above the lowest mask bit
+            uint32_t size;      //How many ids are in each block
+            uint32_t block;     //Free bits of the current block
+            uint32_t offset;    //Next id of the block, for single ids
+            bool done;
+
+            MaskBlocks(CANController SCC, uint32_t code, uint32_t mask, bool ext)
+                : extended(ext), block(0), offset(0), done(false) {
+                uint32_t width = extended ? 0x1FFFFFFF : 0x000007FF;
+                mask &= width;
+                //Bits of the code outside of the mask can't be matched on
+                code &= mask;
+
+                //Count the free bits below the lowest mask bit
+                unsigned short low = 0;
+                while (low < (extended ? 29 : 11) && (mask & (1UL << low)) == 0)
+                    low++;
+
+                size = 1UL << low;
+                free = ~mask & width & ~(size - 1);
+                base = code;
+                if (extended) {
+                    sanitizeExtMask(SCC, base);
+                } else {
+                    sanitizeStdMask(SCC, base);
+                }
+            }
+
+            /**
+             * @return How many blocks the filter splits into
+             */
+            uint32_t blocks() const {
+                uint32_t count = 1;
+                for (uint32_t bits = free; bits != 0; bits &= bits - 1)
+                    count *= 2;
+                return count;
+            }
+
+            /**
+             * Blocks of one or two ids are cheaper as single ids.
+             */
+            bool singles() const {
+                return size <= 2;
+            }
+
+            FilterSection section() const {
+                if (extended)
+                    return singles() ? FilterSection::extended : FilterSection::extendedGroup;
+                return singles() ? FilterSection::standard : FilterSection::standardGroup;
+            }
+
+            /**
+             * @return How many words the filter takes on its own
+             */
+            uint32_t words() const {
+                uint32_t count = blocks();
+                if (extended)
+                    return singles() ? count * size : count * 2;
+                return singles() ? ((count * size) + 1) / 2 : count;
+            }
+
+            /**
+             * Look at the next entry without using it up.
+             * @return false once every block is done
+             */
+            bool peek(FilterEntry & entry) const {
+                if (done)
+                    return false;
+
+                entry.first = base | block;
+                entry.last = entry.first + size - 1;
+                if (singles()) {
+                    entry.first += offset;
+                    entry.last = entry.first;
+                }
+
+                return true;
+            }
+
+            void advance() {
+                if (singles() && ++offset < size)
+                    return;
+                offset = 0;
+
+                //Next combination of the free bits, in ascending order
+                if (block == free) {
+                    done = true;
+                } else {
+                    block = (block - free) & free;
+                }
+            }
+        };
+
+        /**
+         * Table order of operations. Operations on the same filter stay in the
+         * order they were staged.
+         */
+        inline bool operationLess(const FilterOperation & a, const FilterOperation & b) {
+            if (a.section != b.section) return a.section < b.section;
+            if (a.first != b.first)     return a.first < b.first;
+            if (a.last != b.last)       return a.last < b.last;
+            return a.order < b.order;
+        }
+
+        //AFMR bit that turns FullCAN mode on, kept over every mode change
+        const uint32_t fullCANMode = 0b100;
+
+        //Bits of the first word of a FullCAN message object
+        const uint32_t objectSemaphore = 0x03000000;
+        const uint32_t objectWriting = 0x01000000;     //The hardware is storing a frame
+        const uint32_t objectWritten = 0x03000000;     //A frame that hasn't been read
+        const uint32_t objectRemote = 0x40000000;
+
+#ifdef CANFILTER_SNAPSHOTS
+        //"CANF", and the layout version of FilterSnapshot
+        const uint32_t snapshotMagic = 0x464E4143;
+        const uint16_t snapshotVersion = 1;
+
+        /**
+         * Start of a snapshot in flash. The table image follows at
+         * imageOffset, which is the page size so both can be programmed
+         * straight from where they are built.
+         */
+        struct FilterSnapshot {
+            uint32_t magic;
+            uint16_t version;
+            uint16_t words;             //Words in the image
+            uint16_t counts[4];         //Items in each FilterSection
+            uint32_t imageOffset;       //Bytes from the start of the snapshot
+            uint32_t crc;               //CRC-32 of everything above, and the image
+        };
+
+        /**
+         * Continue a CRC-32 (IEEE 802.3) over some bytes, a nibble at a time
+         * to keep the table small.
+         */
+        inline uint32_t crc32(uint32_t crc, const void * data, uint32_t size) {
+            static const uint32_t nibbles[16] = {
+                0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+            };
+            const uint8_t * bytes = static_cast<const uint8_t *>(data);
+
+            crc = ~crc;
+            for (uint32_t i = 0; i < size; i++) {
+                crc = nibbles[(crc ^ bytes[i]) & 0x0F] ^ (crc >> 4);
+                crc = nibbles[(crc ^ (bytes[i] >> 4)) & 0x0F] ^ (crc >> 4);
+            }
+            return ~crc;
+        }
+
+        inline uint32_t snapshotCrc(const FilterSnapshot & snapshot, const uint32_t * image) {
+            uint32_t crc = crc32(0, &snapshot, offsetof(FilterSnapshot, crc));
+            return crc32(crc, image, snapshot.words * 4);
+        }
+#endif
+    }
+
+#ifdef CANFILTER_STATS
+#define CANFILTER_MEASURE(filter, operation) \
+    CANFilter::detail::StatsScope statsScope((filter).stats.operation, (filter).ramReads, (filter).ramWrites)
+#else
+#define CANFILTER_MEASURE(filter, operation)
+#endif
+
+    /**
+     * The filter table of one acceptance filter. Every member works the same
+     * as the free function of the same name in CANFilter.h.
+     * @tparam Backend Register and RAM access, like LPCAcceptanceFilter
+     * @tparam Capacity Words of acceptance filter RAM
+     */
+    template <class Backend, unsigned short Capacity>
+    class BasicCANFilter {
+        static_assert(Capacity >= 2 && Capacity % 2 == 0, "Capacity must be an even number of words");
+        static_assert(Capacity <= 512, "The section registers can't address more than 512 words");
+        static_assert(Backend::controllers >= 1 && Backend::controllers < detail::placeholderController,
+                      "The controller bits have to leave a placeholder controller free");
+        static_assert(CANFILTER_MAX_HANDLERS <= 255, "Handler numbers are stored in a byte");
+
+    public:
+        //Words of acceptance filter RAM
+        static const unsigned short capacity = Capacity;
+
+        void setFilterMode(FilterMode mode)
+        {
+            filterMode = static_cast<int>(mode) | (fullCAN ? detail::fullCANMode : 0);
+            Backend::writeMode(filterMode);
+
+#ifdef CANFILTER_STATS
+            //Time spent anywhere but operating mode
+            if (mode != FilterMode::operating && !bypassOpen) {
+                bypassOpen = true;
+                bypassStart = detail::cycleCount();
+                stats.bypassWindows++;
+            } else if (mode == FilterMode::operating && bypassOpen) {
+                uint32_t cycles = detail::cycleCount() - bypassStart;
+                bypassOpen = false;
+                stats.bypassCycles += cycles;
+                if (cycles > stats.maxBypassCycles)
+                    stats.maxBypassCycles = cycles;
+            }
+#endif
+        }
+
+        void setDoubleBuffering(bool enable)
+        {
+            doubleBuffered = enable;
+        }
+
+        int registerHandler(CANController SCC, uint32_t mask, bool extended, FilterHandler handler)
+        {
+            return registerHandler(SCC, mask, mask, extended, handler);
+        }
+
+        int registerHandler(CANController SCC, uint32_t start, uint32_t end, bool extended, FilterHandler handler)
+        {
+            //Make sure there is room for another handler
+            if (handlerCount >= CANFILTER_MAX_HANDLERS)
+                return -1;
+
+            //Sanitize inputs, so ranges compare the same way as table entries
+            if (extended) {
+                detail::sanitizeExtMask(SCC, start);
+                detail::sanitizeExtMask(SCC, end);
+            } else {
+                detail::sanitizeStdMask(SCC, start);
+                detail::sanitizeStdMask(SCC, end);
+            }
+
+            HandlerRange & range = handlers[handlerCount];
+            range.first = start;
+            range.last = end;
+            range.extended = extended;
+            range.handler = handler;
+            handlerCount++;
+
+            assignHandlers();
+
+            return 0;
+        }
+
+        void clearHandlers()
+        {
+            handlerCount = 0;
+            assignHandlers();
+        }
+
+        bool dispatch(unsigned short index, void * frame)
+        {
+            //Standard entries are counted as half words, extended entries as words
+            unsigned short half = (index < extIndexBase) ? index : extIndexBase + ((index - extIndexBase) * 2);
+            if (half >= Capacity * 2)
+                return false;
+
+            const HandlerSlot & slot = handlerSlots[half / 2];
+            uint8_t number = (half % 2 == 0) ? slot.high : slot.low;
+            if (number == 0)
+                return false;
+
+            handlers[number - 1].handler(frame);
+
+            return true;
+        }
+
+        void resetFilter()
+        {
+            //Reset our item count
+            stdCANCount = 0;
+            stdGrpCANCount = 0;
+            extCANCount = 0;
+            extGrpCANCount = 0;
+            tableBase = 0;
+            sffGrpBase = 0;
+            effBase = 0;
+            effGrpBase = 0;
+            tableEnd = 0;
+            disabledCount = 0;
+            fullCANCount = 0;
+            fullCAN = false;
+            pending.active = false;
+
+#ifdef CANFILTER_STATS
+            detail::startCycleCounter();
+#endif
+
+            //Set the Mode Register to bypass, leave to accept all messages
+            setFilterMode(FilterMode::bypass);
+
+            //Set the Look-Up Table starts to 0 (All off)
+            Backend::writeSections(0, 0, 0, 0, 0);
+        }
+
+        int insertStandardFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, insert);
+
+            //Make sure the table isn't full
+            if(!makeRoom(1))
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, mask);
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::standard, false, mask, mask);
+
+            //Index of the insert location, in half words
+            unsigned short position = findPosition(FilterSection::standard, { mask, mask });
+
+            //Have to set the AFMR to modify mode
+            setFilterMode(FilterMode::bypass);
+
+            //If we have an even number of items, need to make a new word
+            if (stdCANCount % 2 == 0)
+                openWords(sffGrpBase, 1);
+
+            //Slide the standard items over by half a word
+            openStandard(tableBase, position, stdCANCount, mask, findHandler(false, { mask, mask }));
+
+            stdCANCount++;
+            calculateAddresses();
+
+            return 0;
+        }
+        int insertStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, insert);
+
+            //Make sure the table isn't full
+            if(!makeRoom(1))
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, start);
+            detail::sanitizeStdMask(SCC, end);
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::standardGroup, false, start, end);
+
+            //Index of the insert location.
+            unsigned short index = sffGrpBase + findPosition(FilterSection::standardGroup, { start, end });
+
+            //Have to set the AFMR to modify mode
+            setFilterMode(FilterMode::bypass);
+
+            //Make space for new mask
+            openWords(index, 1);
+
+            //Insert new mask, both items in one int
+            writeWord(index, (start << 16) | end);
+            handlerSlots[index].high = findHandler(false, { start, end });
+            handlerSlots[index].low = 0;
+
+            stdGrpCANCount++;
+            calculateAddresses();
+
+            return 0;
+        }
+        int insertExtendedFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, insert);
+
+            //Make sure the table isn't full
+            if(!makeRoom(1))
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, mask);
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::extended, false, mask, mask);
+
+            //Index of the insert location.
+            unsigned short index = effBase + findPosition(FilterSection::extended, { mask, mask });
+
+            //Have to set the AFMR to modify mode
+            setFilterMode(FilterMode::bypass);
+
+            //Make space for new mask
+            openWords(index, 1);
+
+            //Insert new mask
+            writeWord(index, mask);
+            handlerSlots[index].high = findHandler(true, { mask, mask });
+            handlerSlots[index].low = 0;
+
+            extCANCount++;
+            calculateAddresses();
+
+            return 0;
+        }
+        int insertExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, insert);
+
+            //Make sure the table isn't full, with 2 open spaces
+            if(!makeRoom(2))
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, start);
+            detail::sanitizeExtMask(SCC, end);
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::extendedGroup, false, start, end);
+
+            //Index of the insert location.
+            unsigned short index = effGrpBase + (findPosition(FilterSection::extendedGroup, { start, end }) * 2);
+
+            //Have to set the AFMR to modify mode
+            setFilterMode(FilterMode::bypass);
+
+            //Make space for two new masks in one pass
+            openWords(index, 2);
+
+            //Insert new mask start
+            writeWord(index, start);
+            //Insert new mask end
+            writeWord(index + 1, end);
+            handlerSlots[index].high = findHandler(true, { start, end });
+            handlerSlots[index].low = 0;
+            handlerSlots[index + 1].high = 0;
+            handlerSlots[index + 1].low = 0;
+
+            extGrpCANCount++;
+            calculateAddresses();
+
+            return 0;
+        }
+
+        int insertMaskFilter(CANController SCC, uint32_t code, uint32_t mask, bool extended) {
+            CANFILTER_MEASURE(*this, insert);
+
+            MaskBlocks blocks(SCC, code, mask, extended);
+
+            //Make sure the filter can fit before splitting it up
+            if (tableEnd - tableBase + blocks.words() > tableLimit())
+                compactFilters();
+            if (tableEnd - tableBase + blocks.words() > tableLimit())
+                return -1;
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Merge every block into the table in one pass
+            if (buildTable(0, 0, false, &blocks, counts, words, missing) != 0)
+                return -1;
+
+            writeTable(tableImage, words, counts);
+
+            return 0;
+        }
+
+        int loadStaticTable(const uint32_t * words, unsigned short size, const unsigned short counts[4]) {
+            CANFILTER_MEASURE(*this, commit);
+
+            if (size > tableLimit())
+                return -1;
+
+            //Straight from flash, the image is already sorted and packed
+            writeTable(words, size, counts);
+
+            return 0;
+        }
+
+#ifdef CANFILTER_SNAPSHOTS
+        int saveFilterSnapshot(uint32_t address = CANFILTER_SNAPSHOT_ADDRESS) {
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Rebuilding packs the table and drops disabled filters. It only
+            //reads the live table.
+            buildTable(0, 0, false, 0, counts, words, missing);
+
+            mbed::FlashIAP flash;
+            if (flash.init() != 0)
+                return -1;
+
+            uint32_t page = flash.get_page_size();
+            uint32_t imageBytes = ((words * 4) + page - 1) / page * page;
+            uint32_t header[64];
+            int result = -1;
+
+            //The header is programmed as one page, and the image straight from
+            //tableImage, so both have to fit
+            if (page >= sizeof(detail::FilterSnapshot) && page <= sizeof(header) && imageBytes <= sizeof(tableImage)
+                && page + imageBytes <= flash.get_sector_size(address)) {
+                detail::FilterSnapshot & snapshot = *reinterpret_cast<detail::FilterSnapshot *>(header);
+                memset(header, flash.get_erase_value(), page);
+                snapshot.magic = detail::snapshotMagic;
+                snapshot.version = detail::snapshotVersion;
+                snapshot.words = words;
+                for (int s = 0; s < 4; s++) {
+                    snapshot.counts[s] = counts[s];
+                }
+                snapshot.imageOffset = page;
+                snapshot.crc = detail::snapshotCrc(snapshot, tableImage);
+
+                //The header goes last, so a snapshot cut short by a reset is
+                //never valid
+                if (flash.erase(address, flash.get_sector_size(address)) == 0
+                    && (imageBytes == 0 || flash.program(tableImage, address + page, imageBytes) == 0)
+                    && flash.program(header, address, page) == 0)
+                    result = 0;
+            }
+
+            flash.deinit();
+
+            return result;
+        }
+
+        int loadFilterSnapshot(uint32_t address = CANFILTER_SNAPSHOT_ADDRESS) {
+            CANFILTER_MEASURE(*this, commit);
+
+            mbed::FlashIAP flash;
+            if (flash.init() != 0)
+                return -1;
+
+            detail::FilterSnapshot snapshot;
+            int result = -2;
+
+            if (flash.read(&snapshot, address, sizeof(snapshot)) != 0) {
+                result = -1;
+            } else if (snapshot.magic == detail::snapshotMagic && snapshot.version == detail::snapshotVersion
+                       && snapshot.words <= tableLimit() && snapshot.imageOffset >= sizeof(snapshot)) {
+                unsigned short words = 0;
+                for (uint8_t s = 0; s < 4; s++) {
+                    words += detail::sectionWords(static_cast<FilterSection>(s), snapshot.counts[s]);
+                }
+
+                //Checked in tableImage, then copied to the filter in one pass
+                if (words == snapshot.words) {
+                    if (flash.read(tableImage, address + snapshot.imageOffset, words * 4) != 0) {
+                        result = -1;
+                    } else if (detail::snapshotCrc(snapshot, tableImage) == snapshot.crc) {
+                        result = 0;
+                    }
+                }
+            }
+
+            flash.deinit();
+
+            if (result != 0)
+                return result;
+
+            writeTable(tableImage, snapshot.words, snapshot.counts);
+
+            return 0;
+        }
+#endif
+
+        int updateStandardFilter(CANController SCC, uint32_t oldMask, uint32_t newMask) {
+            CANFILTER_MEASURE(*this, update);
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, oldMask);
+            detail::sanitizeStdMask(SCC, newMask);
+
+            return updateFilter(FilterSection::standard, { oldMask, oldMask }, { newMask, newMask }, false);
+        }
+        int updateStandardGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd) {
+            CANFILTER_MEASURE(*this, update);
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, oldStart);
+            detail::sanitizeStdMask(SCC, oldEnd);
+            detail::sanitizeStdMask(SCC, newStart);
+            detail::sanitizeStdMask(SCC, newEnd);
+
+            return updateFilter(FilterSection::standardGroup, { oldStart, oldEnd }, { newStart, newEnd }, false);
+        }
+        int updateExtendedFilter(CANController SCC, uint32_t oldMask, uint32_t newMask) {
+            CANFILTER_MEASURE(*this, update);
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, oldMask);
+            detail::sanitizeExtMask(SCC, newMask);
+
+            return updateFilter(FilterSection::extended, { oldMask, oldMask }, { newMask, newMask }, true);
+        }
+        int updateExtendedGroupFilter(CANController SCC, uint32_t oldStart, uint32_t oldEnd, uint32_t newStart, uint32_t newEnd) {
+            CANFILTER_MEASURE(*this, update);
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, oldStart);
+            detail::sanitizeExtMask(SCC, oldEnd);
+            detail::sanitizeExtMask(SCC, newStart);
+            detail::sanitizeExtMask(SCC, newEnd);
+
+            return updateFilter(FilterSection::extendedGroup, { oldStart, oldEnd }, { newStart, newEnd }, true);
+        }
+
+        int deleteStandardFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, remove);
+
+            //Make sure the table isn't empty
+            if(tableEnd == 0)
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, mask);
+
+            //A disabled filter that was compacted out is only a record
+            if (forgetDisabled(FilterSection::standard, { mask, mask }))
+                return 0;
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::standard, true, mask, mask);
+
+            //Index of the delete location, in half words
+            int position = findEntry(FilterSection::standard, { mask, mask });
+
+            //If the item is not found, don't delete anything
+            if (position < 0) {
+                return -2;
+            }
+
+            setFilterMode(FilterMode::bypass);
+
+            //Slide the standard items after it back by half a word
+            closeStandard(tableBase, position, stdCANCount);
+
+            //If we had an odd number of items, we can shrink the standard filter area
+            if (stdCANCount % 2) {
+                closeWords(sffGrpBase - 1, 1);
+            }
+
+            stdCANCount--;
+            calculateAddresses();
+
+            return 0;
+        }
+        int deleteStandardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, remove);
+
+            //Make sure the table isn't empty
+            if(tableEnd == 0)
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, start);
+            detail::sanitizeStdMask(SCC, end);
+
+            //A disabled filter that was compacted out is only a record
+            if (forgetDisabled(FilterSection::standardGroup, { start, end }))
+                return 0;
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::standardGroup, true, start, end);
+
+            //Index of the delete location.
+            int position = findEntry(FilterSection::standardGroup, { start, end });
+
+            //If the item is not found, don't delete anything
+            if (position < 0) {
+                return -2;
+            }
+
+            setFilterMode(FilterMode::bypass);
+
+            closeWords(sffGrpBase + position, 1);
+
+            stdGrpCANCount--;
+            calculateAddresses();
+
+            return 0;
+        }
+        int deleteExtendedFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, remove);
+
+            //Make sure the table isn't empty
+            if(tableEnd == 0)
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, mask);
+
+            //A disabled filter that was compacted out is only a record
+            if (forgetDisabled(FilterSection::extended, { mask, mask }))
+                return 0;
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::extended, true, mask, mask);
+
+            //Placeholders that copy the filter have to go with it
+            if (hasPlaceholder(FilterSection::extended, { mask, mask }))
+                compactFilters();
+
+            //Index of the delete location.
+            int position = findEntry(FilterSection::extended, { mask, mask });
+
+            //If the item is not found, don't delete anything
+            if (position < 0) {
+                return -2;
+            }
+
+            setFilterMode(FilterMode::bypass);
+
+            closeWords(effBase + position, 1);
+
+            extCANCount--;
+            calculateAddresses();
+
+            return 0;
+        }
+        int deleteExtendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, remove);
+
+            //Make sure the table isn't empty
+            if(tableEnd == 0)
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeExtMask(SCC, start);
+            detail::sanitizeExtMask(SCC, end);
+
+            //A disabled filter that was compacted out is only a record
+            if (forgetDisabled(FilterSection::extendedGroup, { start, end }))
+                return 0;
+
+            //Rebuild the table in the spare half of the RAM instead of shifting
+            if (doubleBuffered)
+                return applyOperation(FilterSection::extendedGroup, true, start, end);
+
+            //Placeholders that copy the filter have to go with it
+            if (hasPlaceholder(FilterSection::extendedGroup, { start, end }))
+                compactFilters();
+
+            //Index of the delete location.
+            int position = findEntry(FilterSection::extendedGroup, { start, end });
+
+            //If the item is not found, don't delete anything
+            if (position < 0) {
+                return -2;
+            }
+
+            setFilterMode(FilterMode::bypass);
+
+            //Delete both items in one pass
+            closeWords(effGrpBase + (position * 2), 2);
+
+            extGrpCANCount--;
+            calculateAddresses();
+
+            return 0;
+        }
+
+        int disableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, toggle);
+
+            bool window = false;
+            int result = disableEntry(section, detail::sanitizeEntry(SCC, section, start, end), window);
+
+            if (window)
+                setFilterMode(FilterMode::operating);
+
+            return result;
+        }
+        int disableFilter(CANController SCC, FilterSection section, uint32_t mask) {
+            return disableFilter(SCC, section, mask, mask);
+        }
+        int disableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count) {
+            CANFILTER_MEASURE(*this, toggle);
+
+            bool groups = (section == FilterSection::standardGroup || section == FilterSection::extendedGroup);
+            bool window = false;
+            int result = 0;
+
+            //Every filter shares one bypass window
+            for (unsigned short i = 0; i < count; i++) {
+                uint32_t start = groups ? masks[i * 2] : masks[i];
+                uint32_t end = groups ? masks[(i * 2) + 1] : masks[i];
+                int status = disableEntry(section, detail::sanitizeEntry(SCC, section, start, end), window);
+                if (result == 0)
+                    result = status;
+            }
+
+            if (window)
+                setFilterMode(FilterMode::operating);
+
+            return result;
+        }
+
+        int enableFilter(CANController SCC, FilterSection section, uint32_t start, uint32_t end) {
+            CANFILTER_MEASURE(*this, toggle);
+
+            bool window = false;
+            int result = enableEntry(section, detail::sanitizeEntry(SCC, section, start, end), window);
+
+            if (window)
+                setFilterMode(FilterMode::operating);
+
+            return result;
+        }
+        int enableFilter(CANController SCC, FilterSection section, uint32_t mask) {
+            return enableFilter(SCC, section, mask, mask);
+        }
+        int enableFilters(CANController SCC, FilterSection section, const uint32_t * masks, unsigned short count) {
+            CANFILTER_MEASURE(*this, toggle);
+
+            bool groups = (section == FilterSection::standardGroup || section == FilterSection::extendedGroup);
+            bool window = false;
+            int result = 0;
+
+            for (unsigned short i = 0; i < count; i++) {
+                uint32_t start = groups ? masks[i * 2] : masks[i];
+                uint32_t end = groups ? masks[(i * 2) + 1] : masks[i];
+                int status = enableEntry(section, detail::sanitizeEntry(SCC, section, start, end), window);
+                if (result == 0)
+                    result = status;
+            }
+
+            if (window)
+                setFilterMode(FilterMode::operating);
+
+            return result;
+        }
+
+        int compactFilters() {
+            CANFILTER_MEASURE(*this, commit);
+
+            bool placed = false;
+            for (unsigned short i = 0; i < disabledCount; i++) {
+                placed = placed || disabled[i].placed;
+            }
+
+            //Nothing to take out
+            if (!placed)
+                return 0;
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Disabled entries and placeholders are dropped by the merge
+            if (buildTable(0, 0, false, 0, counts, words, missing) != 0)
+                return -1;
+
+            writeTable(tableImage, words, counts);
+
+            return 0;
+        }
+
+        void enableFullCAN(bool enable = true) {
+            if (enable == fullCAN)
+                return;
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //The FullCAN section has to start the RAM, so a table in the upper
+            //half is moved down, and so is one behind FullCAN ids being dropped.
+            //Moving the table never makes it bigger.
+            bool move = enable ? (tableBase != 0) : (fullCANCount > 0);
+            if (move)
+                buildTable(0, 0, false, 0, counts, words, missing);
+
+            fullCANCount = 0;
+            fullCAN = enable;
+            //A table staged for commitStep() may no longer go where it was
+            //written
+            revision++;
+
+            if (move)
+                writeTable(tableImage, words, counts);
+
+            //Leave the filter in whatever mode it was in
+            filterMode = (filterMode & ~detail::fullCANMode) | (enable ? detail::fullCANMode : 0);
+            Backend::writeMode(filterMode);
+        }
+
+        int insertFullCANFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, insert);
+
+            if (!fullCAN)
+                return -1;
+
+            //An even count needs a new word, and the objects for both its halves
+            bool newWord = (fullCANCount % 2 == 0);
+            if (newWord && !makeRoom(1 + 6))
+                return -1;
+
+            //Sanitize inputs
+            detail::sanitizeStdMask(SCC, mask);
+
+            //Each id only has one object
+            unsigned short position = findFullCAN(mask);
+            if (position < fullCANCount && (readFullCAN(position) & ~detail::stdDisable) == mask)
+                return 0;
+
+            //Have to set the AFMR to modify mode
+            setFilterMode(FilterMode::bypass);
+
+            unsigned short objects = tableEnd;
+            if (newWord) {
+                //Moves the whole table up a word, and the objects with it
+                openWords(tableBase, 1);
+                tableBase++;
+                objects++;
+            }
+
+            //Slide the FullCAN ids, and their objects, over by one
+            openStandard(0, position, fullCANCount, mask, 0);
+            openObject(objects, position, fullCANCount);
+
+            fullCANCount++;
+            calculateAddresses();
+
+            return 0;
+        }
+
+        int deleteFullCANFilter(CANController SCC, uint32_t mask) {
+            CANFILTER_MEASURE(*this, remove);
+
+            int position = fullCANIndex(SCC, mask);
+
+            //If the id is not found, don't delete anything
+            if (position < 0)
+                return -2;
+
+            setFilterMode(FilterMode::bypass);
+
+            //Slide the FullCAN ids, and their objects, after it back by one
+            closeObject(tableEnd, position, fullCANCount);
+            closeStandard(0, position, fullCANCount);
+
+            //If we had an odd number of ids, the last word is free
+            if (fullCANCount % 2) {
+                closeWords(tableBase - 1, 1);
+                tableBase--;
+            }
+
+            fullCANCount--;
+            calculateAddresses();
+
+            return 0;
+        }
+
+        int fullCANIndex(CANController SCC, uint32_t mask) {
+            detail::sanitizeStdMask(SCC, mask);
+
+            unsigned short position = findFullCAN(mask);
+            if (position < fullCANCount && (readFullCAN(position) & ~detail::stdDisable) == mask)
+                return position;
+
+            return -2;
+        }
+
+        int readFullCANObject(unsigned short index, FullCANObject & object) {
+            if (index >= fullCANCount)
+                return -1;
+
+            unsigned short word = tableEnd + (index * 3);
+
+            //A stuck object or a flood of frames could keep the semaphore
+            //set, so the retries are bounded
+            for (unsigned short attempt = 0; attempt < CANFILTER_FULLCAN_RETRIES; attempt++) {
+                uint32_t control = readWord(word);
+
+                //Still being stored, it only takes a few cycles
+                if ((control & detail::objectSemaphore) == detail::objectWriting)
+                    continue;
+                if ((control & detail::objectSemaphore) != detail::objectWritten)
+                    return -2;
+
+                //Clear the semaphore, then read the data. If the hardware stored
+                //another frame meanwhile, it is set again and the object is read
+                //over.
+                writeObject(word, control & ~detail::objectSemaphore);
+                uint32_t dataA = readWord(word + 1);
+                uint32_t dataB = readWord(word + 2);
+                if ((readWord(word) & detail::objectSemaphore) != 0)
+                    continue;
+
+                object.id = control & 0x000007FF;
+                object.SCC = static_cast<CANController>((control >> 13) & 0x7);
+                object.length = (control >> 16) & 0xF;
+                object.remote = (control & detail::objectRemote) != 0;
+                //The first byte is in the LSB
+                for (unsigned short i = 0; i < 4; i++) {
+                    object.data[i] = dataA >> (i * 8);
+                    object.data[i + 4] = dataB >> (i * 8);
+                }
+
+                return 0;
+            }
+
+            return -2;
+        }
+
+        int verifyMirror() {
+            int mismatches = 0;
+
+            //Only the FullCAN section and the table are ever read from the mirror
+            for (unsigned short i = 0; i < fullCANWords(); i++) {
+                if (readPeripheral(i) != mirror[i])
+                    mismatches++;
+            }
+            for (unsigned short i = tableBase; i < tableEnd; i++) {
+                if (readPeripheral(i) != mirror[i])
+                    mismatches++;
+            }
+
+            uint32_t registers[5];
+            Backend::readSections(registers);
+            const unsigned short bases[5] = { tableBase, sffGrpBase, effBase, effGrpBase, tableEnd };
+            for (unsigned short i = 0; i < 5; i++) {
+                if (registers[i] != bases[i] * 4u)
+                    mismatches++;
+            }
+            if (Backend::readMode() != filterMode)
+                mismatches++;
+
+            return mismatches;
+        }
+
+        int commitStep(unsigned short budget) {
+            CANFILTER_MEASURE(*this, step);
+
+            if (!pending.active)
+                return 0;
+
+            //Something else changed the table or the image first. The live
+            //table hasn't been written over, so there is nothing to undo.
+            if (pending.revision != revision) {
+                pending.active = false;
+                return -2;
+            }
+
+            //A table that can't be staged goes over the live one in a single
+            //bypass window, like commit(), instead of leaving the filter
+            //open to every frame between steps
+            if (pending.inPlace) {
+                pending.active = false;
+                writeTable(tableImage, pending.words, pending.counts);
+                return 0;
+            }
+
+            if (pending.done == pending.words) {
+                //Every word is written, swap the section registers over
+                pending.active = false;
+                setFilterMode(FilterMode::bypass);
+                placeTable(pending.base, pending.counts);
+                return 0;
+            }
+
+            for (unsigned short n = 0; (n < budget || n == 0) && pending.done < pending.words; n++, pending.done++) {
+                writeWord(pending.base + pending.done, tableImage[pending.done]);
+            }
+
+            pending.revision = revision;
+
+            return 1;
+        }
+
+        void cancelCommit() {
+            pending.active = false;
+        }
+
+        void getCommitProgress(CommitProgress & progress) {
+            progress.pending = pending.active;
+            progress.inPlace = pending.active && pending.inPlace;
+            progress.words = pending.active ? pending.words : 0;
+            progress.wordsLeft = pending.active ? pending.words - pending.done : 0;
+        }
+
+        bool isAccepted(CANController SCC, uint32_t id, bool extended) {
+            //Bypass lets every frame through, off none
+            if (filterMode & static_cast<uint32_t>(FilterMode::bypass))
+                return true;
+            if (filterMode & static_cast<uint32_t>(FilterMode::off))
+                return false;
+
+            if (extended) {
+                detail::sanitizeExtMask(SCC, id);
+                return holdsId(FilterSection::extended, id) || findGroup(FilterSection::extendedGroup, id) >= 0;
+            }
+
+            detail::sanitizeStdMask(SCC, id);
+
+            //FullCAN ids are matched before the rest of the table
+            if (fullCAN) {
+                unsigned short position = findFullCAN(id);
+                if (position < fullCANCount && readFullCAN(position) == id)
+                    return true;
+            }
+
+            return holdsId(FilterSection::standard, id) || findGroup(FilterSection::standardGroup, id) >= 0;
+        }
+
+        unsigned short count(FilterSection section) {
+            return sectionCount(section);
+        }
+
+        FilterRange sectionFilters(FilterSection section) {
+            return FilterRange(section, mirror + sectionBase(section), sectionCount(section), disabled, disabledCount);
+        }
+
+        int applyFilterSet(CANController SCC, FilterSet & set) {
+            CANFILTER_MEASURE(*this, commit);
+
+            //Put the set in table order for this controller
+            for (unsigned short i = 0; i < set.entryCount; i++) {
+                FilterOperation & entry = set.entries[i];
+                if (entry.section <= static_cast<uint8_t>(FilterSection::standardGroup)) {
+                    detail::sanitizeStdMask(SCC, entry.first);
+                    detail::sanitizeStdMask(SCC, entry.last);
+                } else {
+                    detail::sanitizeExtMask(SCC, entry.first);
+                    detail::sanitizeExtMask(SCC, entry.last);
+                }
+            }
+            std::sort(set.entries, set.entries + set.entryCount, detail::operationLess);
+
+            unsigned short kept = 0;
+            for (unsigned short i = 0; i < set.entryCount; i++) {
+                if (kept == 0 || detail::operationLess(set.entries[kept - 1], set.entries[i]))
+                    set.entries[kept++] = set.entries[i];
+            }
+            set.entryCount = kept;
+
+            //The set replaces the disabled filters of this controller too
+            forgetController(SCC);
+
+            unsigned short changes = countChanges(SCC, set.entries, set.entryCount);
+            if (changes == 0)
+                return 0;
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Drop the controller's live filters and merge in the set, in one pass
+            if (buildTable(set.entries, set.entryCount, false, 0, counts, words, missing, static_cast<int>(SCC)) != 0)
+                return -1;
+
+            writeTable(tableImage, words, counts);
+
+            return changes;
+        }
+
+        int clearController(CANController SCC) {
+            CANFILTER_MEASURE(*this, commit);
+
+            forgetController(SCC);
+
+            unsigned short changes = countChanges(SCC, 0, 0);
+            if (changes == 0)
+                return 0;
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Dropping items never makes the table bigger
+            buildTable(0, 0, false, 0, counts, words, missing, static_cast<int>(SCC));
+            writeTable(tableImage, words, counts);
+
+            return changes;
+        }
+
+        int replaceController(CANController SCC, FilterSet & set) {
+            return applyFilterSet(SCC, set);
+        }
+
+        int copyController(CANController from, CANController to) {
+            CANFILTER_MEASURE(*this, commit);
+
+            if (from == to)
+                return 0;
+
+            forgetController(to);
+
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            //Drop the target's filters and merge in the source's, in one pass
+            if (buildTable(0, 0, false, 0, counts, words, missing, static_cast<int>(to), static_cast<int>(from)) != 0)
+                return -1;
+
+            writeTable(tableImage, words, counts);
+
+            return 0;
+        }
+
+#ifdef CANFILTER_STATS
+        void getStats(FilterStats & out) {
+            //Reading LUTerrAd clears LUTerr
+            if (Backend::lookupError(stats.lastErrorAddress))
+                stats.lookupErrors++;
+
+            out = stats;
+
+            unsigned short used = 0;
+            unsigned short wasted = stdCANCount % 2;
+            for (uint8_t s = 0; s < 4; s++) {
+                FilterSection section = static_cast<FilterSection>(s);
+                unsigned short count = sectionCount(section);
+                //Half words taken by one item of the section
+                unsigned short halves = detail::sectionWords(section, 2);
+                FilterEntry previous = { 0, 0 };
+
+                out.sectionWords[s] = detail::sectionWords(section, count);
+                used += out.sectionWords[s];
+
+                //Disabled filters, and the placeholders left by extended ones
+                for (unsigned short i = 0; i < count; i++) {
+                    FilterEntry entry = readEntry(section, i);
+                    bool placeholder = (s >= 2 && i > 0 && entry == previous);
+                    if (detail::isDisabled(section, entry) || placeholder)
+                        wasted += halves;
+                    previous = entry;
+                }
+            }
+
+            out.freeWords = tableLimit() - used;
+            out.wastedHalfWords = wasted;
+        }
+
+        void resetStats() {
+            stats = FilterStats();
+            detail::startCycleCounter();
+
+            //A window that is already open counts from now
+            if (bypassOpen) {
+                stats.bypassWindows = 1;
+                bypassStart = detail::cycleCount();
+            }
+        }
+#endif
+    private:
+        //The helper classes work on the filter of the free functions
+        friend class FilterTransaction;
+        friend class FilterQueue;
+        friend class SoftwareFilter;
+        friend class TrafficMonitor;
+
+        typedef detail::FilterEntry FilterEntry;
+        typedef detail::MaskBlocks MaskBlocks;
+        typedef detail::DisabledFilter DisabledFilter;
+
+        //Have to keep track of how many IDs we have
+        unsigned short stdCANCount = 0;     //Word Size: 1/2
+        unsigned short stdGrpCANCount = 0;  //Word Size: 1
+        unsigned short extCANCount = 0;     //Word Size: 1
+        unsigned short extGrpCANCount = 0;  //Word Size: 2
+
+        //Word of the acceptance filter RAM the table starts at
+        unsigned short tableBase = 0;
+        //Build new tables in the spare half of the RAM
+        bool doubleBuffered = false;
+
+        //FullCAN ids, in front of the table from word 0. Word Size: 1/2, and
+        //3 for the message object of each half word after the table
+        unsigned short fullCANCount = 0;
+        bool fullCAN = false;
+
+        /**
+         * Handler numbers of the two entries held in a word of the table, in
+         * the same layout as LPC_CANAF_RAM->mask. 0 means no handler.
+         * Extended entries only use high.
+         */
+        struct HandlerSlot {
+            uint8_t high;   //Entry in the MSB
+            uint8_t low;    //Entry in the LSB
+        };
+        HandlerSlot handlerSlots[Capacity] = {};
+
+        /**
+         * A handler and the ids it was registered for, sanitized the same way
+         * as the table entries.
+         */
+        struct HandlerRange {
+            uint32_t first;
+            uint32_t last;
+            bool extended;
+            FilterHandler handler;
+        };
+        HandlerRange handlers[CANFILTER_MAX_HANDLERS] = {};
+        unsigned short handlerCount = 0;
+
+        //ID index of the first extended entry, for dispatch()
+        unsigned short extIndexBase = 0;
+
+#ifdef CANFILTER_STATS
+        //Everything getStats() reports that has to be counted as it happens
+        FilterStats stats = {};
+        unsigned long ramReads = 0;
+        unsigned long ramWrites = 0;
+        bool bypassOpen = false;
+        uint32_t bypassStart = 0;
+#endif
+
+        //Copy of every word written to the acceptance filter RAM. Reading the
+        //peripheral goes over the APB bus, several times slower than SRAM, so
+        //the table is only ever searched here.
+        uint32_t mirror[Capacity] = {};
+
+        //Where the sections start and the table ends, in words, so the
+        //section registers are never read back. The standard section starts
+        //at tableBase.
+        unsigned short sffGrpBase = 0;
+        unsigned short effBase = 0;
+        unsigned short effGrpBase = 0;
+        unsigned short tableEnd = 0;
+
+        //Last value written to the AFMR
+        uint32_t filterMode = 0;
+
+        //Bumped by every write to the table RAM and every rebuild of the
+        //table image, so a commit written in steps knows it was overtaken
+        unsigned long revision = 0;
+
+        /**
+         * The table image commitStep() is writing, a few words per step.
+         */
+        struct PendingCommit {
+            bool active;
+            bool inPlace;               //Over the live table, in one step
+            unsigned short base;        //Word the image is staged at
+            unsigned short words;       //Words of the image
+            unsigned short counts[4];   //Items in each section of the image
+            unsigned short done;        //Words staged so far
+            unsigned long revision;     //revision after the last step
+        };
+        PendingCommit pending = {};
+
+        /**
+         * Read a word straight from the acceptance filter RAM. Only the FullCAN
+         * message objects need this, since the hardware writes them.
+         */
+        inline uint32_t readPeripheral(unsigned short index) {
+#ifdef CANFILTER_STATS
+            ramReads++;
+#endif
+            return Backend::readRam(index);
+        }
+
+        /**
+         * Read a word of the acceptance filter RAM from the mirror. The
+         * FullCAN message objects past the end of the table are read from the
+         * peripheral.
+         */
+        inline uint32_t readWord(unsigned short index) {
+            if (index >= tableEnd)
+                return readPeripheral(index);
+            return mirror[index];
+        }
+
+        /**
+         * Write a word of the acceptance filter RAM, and the mirror.
+         */
+        inline void writeWord(unsigned short index, uint32_t data) {
+            writeObject(index, data);
+            revision++;
+        }
+
+        /**
+         * Write a word of a FullCAN message object, which doesn't change the
+         * table, so a commit written in steps goes on.
+         */
+        inline void writeObject(unsigned short index, uint32_t data) {
+#ifdef CANFILTER_STATS
+            ramWrites++;
+#endif
+            mirror[index] = data;
+            Backend::writeRam(index, data);
+        }
+
+        /**
+         * Words in front of the table taken by the FullCAN section.
+         */
+        unsigned short fullCANWords() {
+            return (fullCANCount + 1) / 2;
+        }
+
+        /**
+         * Words after the table taken by the FullCAN message objects. The
+         * hardware numbers them by half word of the FullCAN section, so the
+         * padding of an odd count has one too.
+         */
+        unsigned short objectWords() {
+            return fullCANWords() * 2 * 3;
+        }
+
+        /**
+         * Most words the four sections of the table can take up, around the
+         * FullCAN section and its message objects.
+         */
+        unsigned short tableLimit() {
+            return Capacity - fullCANWords() - objectWords();
+        }
+
+        /**
+         * Calculate the start and end points of the memory sections. You must
+         * take the size, in words * 4, that will be occupied by each section.
+         * So, offset + (#words * 4) is the equation used for this.
+         */
+        void calculateAddresses()
+        {
+            //Set the Mode Register to bypass, allow writes to registers
+            setFilterMode(FilterMode::bypass);
+
+            sffGrpBase = tableBase + ((stdCANCount + 1) / 2);
+            effBase = sffGrpBase + stdGrpCANCount;
+            effGrpBase = effBase + extCANCount;
+            tableEnd = effGrpBase + (extGrpCANCount * 2);
+
+            Backend::writeSections(tableBase * 4, sffGrpBase * 4, effBase * 4, effGrpBase * 4, tableEnd * 4);
+
+            //Standard entries are counted as half words in the ID index
+            extIndexBase = effBase * 2;
+
+            //Set the Mode Register to operating, use the filter
+            setFilterMode(FilterMode::operating);
+        }
+
+        /**
+         * Move every word of the table from index to the end up by count,
+         * opening count words at index. One pass, starting from the end. The
+         * FullCAN message objects move with the end of the table.
+         */
+        void openWords(unsigned short index, unsigned short count) {
+            for (unsigned short i = tableEnd + objectWords(); i > index; i--) {
+                writeWord(i - 1 + count, readWord(i - 1));
+                handlerSlots[i - 1 + count] = handlerSlots[i - 1];
+            }
+        }
+
+        /**
+         * Move every word of the table after the count words at index down by
+         * count, closing the gap. One pass, starting from index.
+         */
+        void closeWords(unsigned short index, unsigned short count) {
+            for (unsigned short i = index + count; i < tableEnd + objectWords(); i++) {
+                writeWord(i - count, readWord(i));
+                handlerSlots[i - count] = handlerSlots[i];
+            }
+        }
+
+        /**
+         * Move the standard filters from position up by one half word and put
+         * mask at position. The word for an even count must already be open.
+         * Each word is read and written once, starting from the end.
+         * @param base Word the section starts at, the standard or FullCAN one
+         * @param position Item of the section to insert at
+         * @param count Number of filters in the section before the insert
+         */
+        void openStandard(unsigned short base, unsigned short position, unsigned short count, uint32_t mask, uint8_t handler) {
+            unsigned short first = position / 2;
+            //Word holding item count once the insert is done
+            unsigned short last = count / 2;
+
+            //Only read words that held items before the insert
+            uint32_t current = (count % 2) ? readWord(base + last) : 0xFFFFFFFF;
+            HandlerSlot currentSlot = handlerSlots[base + last];
+
+            for (unsigned short w = last; ; w--) {
+                uint32_t below = (w > first) ? readWord(base + w - 1) : 0;
+                HandlerSlot belowSlot = (w > first) ? handlerSlots[base + w - 1] : HandlerSlot();
+                uint32_t halves[2];
+                uint8_t slots[2];
+
+                for (unsigned short h = 0; h < 2; h++) {
+                    unsigned short item = (w * 2) + h;
+                    if (item > count) {
+                        halves[h] = detail::stdPadding;
+                        slots[h] = 0;
+                    } else if (item == position) {
+                        halves[h] = mask;
+                        slots[h] = handler;
+                    } else if (item > position) {
+                        //Takes the item before it, the LSB of the word below
+                        //or the MSB of this word
+                        halves[h] = (h == 0) ? (below & 0x0000FFFF) : (current >> 16);
+                        slots[h] = (h == 0) ? belowSlot.low : currentSlot.high;
+                    } else {
+                        halves[h] = (h == 0) ? (current >> 16) : (current & 0x0000FFFF);
+                        slots[h] = (h == 0) ? currentSlot.high : currentSlot.low;
+                    }
+                }
+
+                writeWord(base + w, (halves[0] << 16) | halves[1]);
+                handlerSlots[base + w].high = slots[0];
+                handlerSlots[base + w].low = slots[1];
+
+                if (w == first)
+                    break;
+                current = below;
+                currentSlot = belowSlot;
+            }
+        }
+
+        /**
+         * Move the standard filters after position down by one half word,
+         * deleting the item at position and padding the freed half. Each word
+         * is read and written once, starting from position.
+         * @param base Word the section starts at, the standard or FullCAN one
+         * @param position Item of the section to delete
+         * @param count Number of filters in the section before the delete
+         */
+        void closeStandard(unsigned short base, unsigned short position, unsigned short count) {
+            unsigned short last = (count - 1) / 2;
+
+            uint32_t current = readWord(base + (position / 2));
+            HandlerSlot currentSlot = handlerSlots[base + (position / 2)];
+
+            for (unsigned short w = position / 2; w <= last; w++) {
+                uint32_t above = (w < last) ? readWord(base + w + 1) : 0;
+                HandlerSlot aboveSlot = (w < last) ? handlerSlots[base + w + 1] : HandlerSlot();
+                uint32_t halves[2];
+                uint8_t slots[2];
+
+                for (unsigned short h = 0; h < 2; h++) {
+                    unsigned short item = (w * 2) + h;
+                    if (item >= count - 1) {
+                        halves[h] = detail::stdPadding;
+                        slots[h] = 0;
+                    } else if (item >= position) {
+                        //Takes the item after it, the LSB of this word or the
+                        //MSB of the word above
+                        halves[h] = (h == 0) ? (current & 0x0000FFFF) : (above >> 16);
+                        slots[h] = (h == 0) ? currentSlot.low : aboveSlot.high;
+                    } else {
+                        halves[h] = current >> 16;
+                        slots[h] = currentSlot.high;
+                    }
+                }
+
+                writeWord(base + w, (halves[0] << 16) | halves[1]);
+                handlerSlots[base + w].high = slots[0];
+                handlerSlots[base + w].low = slots[1];
+
+                current = above;
+                currentSlot = aboveSlot;
+            }
+        }
+
+        //Where new tables are built before being written to the filter
+        uint32_t tableImage[Capacity] = {};
+
+        /**
+         * How many items are currently in a section of the filter.
+         */
+        unsigned short sectionCount(FilterSection section) {
+            switch (section) {
+                case FilterSection::standard:       return stdCANCount;
+                case FilterSection::standardGroup:  return stdGrpCANCount;
+                case FilterSection::extended:       return extCANCount;
+                default:                            return extGrpCANCount;
+            }
+        }
+
+        /**
+         * Read item index of a section of the table.
+         */
+        FilterEntry readEntry(FilterSection section, unsigned short index) {
+            //Every item of the table is in the mirror
+            return detail::decodeEntry(section, mirror + sectionBase(section), index);
+        }
+
+        /**
+         * Binary search a section of the acceptance filter RAM for the first
+         * item that doesn't sort before entry.
+         * @return Item index to insert entry at, or of entry if it is there
+         */
+        unsigned short findPosition(FilterSection section, const FilterEntry & entry) {
+            unsigned short low = 0;
+            unsigned short high = sectionCount(section);
+
+            while (low < high) {
+                unsigned short middle = (low + high) / 2;
+                if (detail::entryKey(section, readEntry(section, middle)) < entry) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            return low;
+        }
+
+        /**
+         * Binary search a section of the acceptance filter RAM for entry.
+         * @return Item index of entry, or -1 if it is not there
+         */
+        int findEntry(FilterSection section, const FilterEntry & entry) {
+            unsigned short position = findPosition(section, entry);
+
+            if (position < sectionCount(section) && detail::entryKey(section, readEntry(section, position)) == entry)
+                return position;
+
+            return -1;
+        }
+
+        /**
+         * Write item index of a section, starting at word base, into the table
+         * image.
+         */
+        void writeEntry(FilterSection section, unsigned short base, unsigned short index, const FilterEntry & entry) {
+            switch (section) {
+                case FilterSection::standard:
+                    if (index % 2 == 0) {
+                        //New word, the LSB stays padding until it is filled
+                        tableImage[base + (index / 2)] = (entry.first << 16) | detail::stdPadding;
+                    } else {
+                        tableImage[base + (index / 2)] = (tableImage[base + (index / 2)] & 0xFFFF0000) | entry.first;
+                    }
+                    break;
+                case FilterSection::standardGroup:
+                    tableImage[base + index] = (entry.first << 16) | entry.last;
+                    break;
+                case FilterSection::extended:
+                    tableImage[base + index] = entry.first;
+                    break;
+                default:
+                    tableImage[base + (index * 2)] = entry.first;
+                    tableImage[base + (index * 2) + 1] = entry.last;
+                    break;
+            }
+        }
+
+        /**
+         * Find the handler for a table entry. The most recently registered
+         * range that holds the whole entry wins.
+         * @return The handler number, or 0 if there is none
+         */
+        uint8_t findHandler(bool extended, const FilterEntry & entry) {
+            for (unsigned short i = handlerCount; i > 0; i--) {
+                const HandlerRange & range = handlers[i - 1];
+                if (range.extended == extended && range.first <= entry.first && entry.last <= range.last)
+                    return i;
+            }
+
+            return 0;
+        }
+
+        /**
+         * Work out the handler of every entry in the table from scratch. Used
+         * after the whole table is rewritten.
+         */
+        void assignHandlers() {
+            for (unsigned short i = 0; i < Capacity; i++) {
+                handlerSlots[i].high = 0;
+                handlerSlots[i].low = 0;
+            }
+
+            if (handlerCount == 0)
+                return;
+
+            for (unsigned short i = 0; i < stdCANCount; i++) {
+                HandlerSlot & slot = handlerSlots[tableBase + (i / 2)];
+                uint8_t number = findHandler(false, readEntry(FilterSection::standard, i));
+                if (i % 2 == 0) {
+                    slot.high = number;
+                } else {
+                    slot.low = number;
+                }
+            }
+            for (unsigned short i = 0; i < stdGrpCANCount; i++) {
+                handlerSlots[sffGrpBase + i].high = findHandler(false, readEntry(FilterSection::standardGroup, i));
+            }
+            for (unsigned short i = 0; i < extCANCount; i++) {
+                handlerSlots[effBase + i].high = findHandler(true, readEntry(FilterSection::extended, i));
+            }
+            for (unsigned short i = 0; i < extGrpCANCount; i++) {
+                handlerSlots[effGrpBase + (i * 2)].high = findHandler(true, readEntry(FilterSection::extendedGroup, i));
+            }
+        }
+
+        /**
+         * Word of the acceptance filter RAM a section starts at.
+         */
+        unsigned short sectionBase(FilterSection section) {
+            switch (section) {
+                case FilterSection::standard:       return tableBase;
+                case FilterSection::standardGroup:  return sffGrpBase;
+                case FilterSection::extended:       return effBase;
+                default:                            return effGrpBase;
+            }
+        }
+
+        /**
+         * Write a standard entry to one half of a word of the acceptance filter
+         * RAM, even items in the MSB and odd items in the LSB.
+         */
+        void writeHalf(unsigned short base, unsigned short item, uint32_t half, uint8_t handler) {
+            unsigned short index = base + (item / 2);
+
+            if (item % 2 == 0) {
+                writeWord(index, (half << 16) | (readWord(index) & 0x0000FFFF));
+                handlerSlots[index].high = handler;
+            } else {
+                writeWord(index, (readWord(index) & 0xFFFF0000) | half);
+                handlerSlots[index].low = handler;
+            }
+        }
+
+        /**
+         * Replace item from of a section with entry, and move it to where it
+         * sorts. Only the items between the old and new places are moved over,
+         * so the section stays the same size.
+         */
+        void moveEntry(FilterSection section, unsigned short from, const FilterEntry & entry, uint8_t handler) {
+            unsigned short base = sectionBase(section);
+            unsigned short to = findPosition(section, entry);
+
+            //Everything after from moves down a place once it is taken out
+            if (to > from)
+                to--;
+
+            if (section == FilterSection::standard) {
+                //Standard items are half words, so move them one at a time
+                while (from != to) {
+                    unsigned short next = (from < to) ? from + 1 : from - 1;
+                    HandlerSlot slot = handlerSlots[base + (next / 2)];
+                    FilterEntry moved = readEntry(section, next);
+
+                    writeHalf(base, from, moved.first, (next % 2 == 0) ? slot.high : slot.low);
+                    from = next;
+                }
+
+                writeHalf(base, to, entry.first, handler);
+                return;
+            }
+
+            //Every other section moves whole items of one or two words
+            unsigned short stride = detail::sectionWords(section, 1);
+            if (from < to) {
+                for (unsigned short i = from * stride; i < to * stride; i++) {
+                    writeWord(base + i, readWord(base + i + stride));
+                    handlerSlots[base + i] = handlerSlots[base + i + stride];
+                }
+            } else {
+                for (unsigned short i = (from + 1) * stride; i > (to + 1) * stride; i--) {
+                    writeWord(base + i - 1, readWord(base + i - 1 - stride));
+                    handlerSlots[base + i - 1] = handlerSlots[base + i - 1 - stride];
+                }
+            }
+
+            unsigned short index = base + (to * stride);
+            switch (section) {
+                case FilterSection::standardGroup:
+                    writeWord(index, (entry.first << 16) | entry.last);
+                    break;
+                case FilterSection::extended:
+                    writeWord(index, entry.first);
+                    break;
+                default:
+                    writeWord(index, entry.first);
+                    writeWord(index + 1, entry.last);
+                    handlerSlots[index + 1].high = 0;
+                    break;
+            }
+            handlerSlots[index].high = handler;
+            handlerSlots[index].low = 0;
+        }
+
+        DisabledFilter disabled[CANFILTER_MAX_DISABLED] = {};
+        unsigned short disabledCount = 0;
+
+        /**
+         * @return Index of the record of a disabled filter, or -1
+         */
+        int findDisabled(FilterSection section, const FilterEntry & entry) {
+            for (unsigned short i = 0; i < disabledCount; i++) {
+                if (disabled[i].section == static_cast<uint8_t>(section) && disabled[i].entry == entry)
+                    return i;
+            }
+
+            return -1;
+        }
+
+        /**
+         * If a placeholder in the table is a copy of entry.
+         */
+        bool hasPlaceholder(FilterSection section, const FilterEntry & entry) {
+            for (unsigned short i = 0; i < disabledCount; i++) {
+                if (disabled[i].placed && disabled[i].section == static_cast<uint8_t>(section)
+                    && disabled[i].placeholder == entry)
+                    return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Drop the record of a disabled filter that is being deleted. The
+         * placeholders of an extended filter copy a neighbour, so they are
+         * compacted out first, while the record still tells them from the
+         * neighbour itself. With double buffering on, a standard filter is
+         * compacted out the same way, since the rebuild of the delete would
+         * skip the disabled entry and not find it.
+         * @return true if the filter isn't in the table as itself, so there is
+         *  nothing left to delete
+         */
+        bool forgetDisabled(FilterSection section, const FilterEntry & entry) {
+            int index = findDisabled(section, entry);
+            if (index < 0)
+                return false;
+
+            bool placed = disabled[index].placed;
+            bool extended = section == FilterSection::extended || section == FilterSection::extendedGroup;
+            bool compact = placed && (extended || doubleBuffered);
+
+            //If the rebuild fails the record stays, so the copies are still
+            //known to be placeholders
+            if (compact && compactFilters() != 0)
+                return true;
+
+            index = findDisabled(section, entry);
+            disabled[index] = disabled[--disabledCount];
+
+            return !placed || compact;
+        }
+
+        /**
+         * Drop the records of every disabled filter of a controller, whose
+         * filters are about to be rebuilt.
+         */
+        void forgetController(CANController SCC) {
+            for (unsigned short i = 0; i < disabledCount; ) {
+                FilterSection section = static_cast<FilterSection>(disabled[i].section);
+                if (detail::entryController(section, disabled[i].entry) == static_cast<unsigned>(SCC)) {
+                    disabled[i] = disabled[--disabledCount];
+                } else {
+                    i++;
+                }
+            }
+        }
+
+        /**
+         * Disable one filter in place. Standard entries only have their
+         * disable bit set, which is allowed while the filter is operating.
+         * Extended entries are overwritten with a copy of a neighbour, in
+         * bypass.
+         * @param window If the filter is already in bypass, updated if this
+         *  opens a window
+         * @return 0 on success, -1 if no more filters can be disabled, -2 if
+         *  the filter was not found
+         */
+        int disableEntry(FilterSection section, const FilterEntry & entry, bool & window) {
+            if (findDisabled(section, entry) >= 0)
+                return 0;
+            if (disabledCount >= CANFILTER_MAX_DISABLED)
+                return -1;
+
+            int position = findEntry(section, entry);
+            if (position < 0)
+                return -2;
+
+            DisabledFilter & record = disabled[disabledCount];
+            record.entry = entry;
+            record.placeholder = entry;
+            record.section = static_cast<uint8_t>(section);
+            record.placed = true;
+
+            unsigned short base = sectionBase(section);
+            unsigned short count = sectionCount(section);
+            unsigned short stride = detail::sectionWords(section, 1);
+
+            switch (section) {
+                case FilterSection::standard:
+                    if (position % 2 == 0) {
+                        writeWord(base + (position / 2), readWord(base + (position / 2)) | (detail::stdDisable << 16));
+                    } else {
+                        writeWord(base + (position / 2), readWord(base + (position / 2)) | detail::stdDisable);
+                    }
+                    break;
+                case FilterSection::standardGroup:
+                    writeWord(base + position, readWord(base + position) | (detail::stdDisable << 16) | detail::stdDisable);
+                    break;
+                default: {
+                    //Placeholders of other filters may be copies of this one,
+                    //and sit right after it
+                    unsigned short last = position;
+                    while (last + 1 < count && readEntry(section, last + 1) == entry)
+                        last++;
+
+                    //Copying a neighbour keeps the section sorted and accepts
+                    //nothing new
+                    int neighbour = (position > 0) ? position - 1 : ((last + 1 < count) ? last + 1 : -1);
+                    HandlerSlot slot = HandlerSlot();
+                    if (neighbour >= 0) {
+                        record.placeholder = readEntry(section, neighbour);
+                        slot = handlerSlots[base + (neighbour * stride)];
+                    } else {
+                        record.placeholder.first = (entry.first & 0x1FFFFFFF) | (detail::placeholderController << 29);
+                        record.placeholder.last = record.placeholder.first;
+                    }
+
+                    if (!window) {
+                        setFilterMode(FilterMode::bypass);
+                        window = true;
+                    }
+
+                    for (unsigned short i = position; i <= last; i++) {
+                        unsigned short index = base + (i * stride);
+                        writeWord(index, record.placeholder.first);
+                        if (section == FilterSection::extendedGroup)
+                            writeWord(index + 1, record.placeholder.last);
+                        handlerSlots[index] = slot;
+                    }
+
+                    for (unsigned short i = 0; i < disabledCount; i++) {
+                        if (disabled[i].placed && disabled[i].section == record.section && disabled[i].placeholder == entry)
+                            disabled[i].placeholder = record.placeholder;
+                    }
+                    break;
+                }
+            }
+
+            disabledCount++;
+
+            return 0;
+        }
+
+        /**
+         * Enable a filter that was disabled with disableEntry(). If the table
+         * was rebuilt since, the filter is inserted again.
+         * @param window If the filter is already in bypass, updated if this
+         *  opens or closes a window
+         * @return 0 on success, -1 if the table is full, -2 if the filter was
+         *  not disabled
+         */
+        int enableEntry(FilterSection section, const FilterEntry & entry, bool & window) {
+            int index = findDisabled(section, entry);
+            if (index < 0)
+                return -2;
+
+            DisabledFilter record = disabled[index];
+            disabled[index] = disabled[--disabledCount];
+
+            int result = 0;
+            if (!record.placed) {
+                //Inserting closes any window of its own
+                if (window)
+                    setFilterMode(FilterMode::operating);
+                window = false;
+
+                switch (section) {
+                    case FilterSection::standard:
+                        result = insertStandardFilter(static_cast<CANController>(entry.first >> 13), entry.first);
+                        break;
+                    case FilterSection::standardGroup:
+                        result = insertStandardGroupFilter(static_cast<CANController>(entry.first >> 13), entry.first, entry.last);
+                        break;
+                    case FilterSection::extended:
+                        result = insertExtendedFilter(static_cast<CANController>(entry.first >> 29), entry.first);
+                        break;
+                    default:
+                        result = insertExtendedGroupFilter(static_cast<CANController>(entry.first >> 29), entry.first, entry.last);
+                        break;
+                }
+
+                //Still disabled if it didn't fit, so keep the record
+                if (result != 0)
+                    disabled[disabledCount++] = record;
+
+                return result;
+            }
+
+            unsigned short base = sectionBase(section);
+
+            if (section == FilterSection::standard || section == FilterSection::standardGroup) {
+                //Find the disabled copy, duplicates sort next to each other
+                unsigned short count = sectionCount(section);
+                for (unsigned short i = findPosition(section, entry); i < count; i++) {
+                    FilterEntry item = readEntry(section, i);
+                    if (!(detail::entryKey(section, item) == entry))
+                        break;
+                    if (!detail::isDisabled(section, item))
+                        continue;
+
+                    unsigned short word = base + ((section == FilterSection::standard) ? (i / 2) : i);
+                    if (section == FilterSection::standardGroup) {
+                        writeWord(word, readWord(word) & ~((detail::stdDisable << 16) | detail::stdDisable));
+                    } else if (i % 2 == 0) {
+                        writeWord(word, readWord(word) & ~(detail::stdDisable << 16));
+                    } else {
+                        writeWord(word, readWord(word) & ~detail::stdDisable);
+                    }
+                    break;
+                }
+
+                return 0;
+            }
+
+            //Any copy of the placeholder will do, moveEntry puts the filter
+            //back where it sorts
+            int position = findEntry(section, record.placeholder);
+            if (position < 0)
+                return -2;
+
+            if (!window) {
+                setFilterMode(FilterMode::bypass);
+                window = true;
+            }
+            moveEntry(section, position, entry, findHandler(true, entry));
+
+            return 0;
+        }
+
+        /**
+         * Walks one section of the live table merged with the operations for
+         * that section, or the blocks of a mask filter, yielding the entries
+         * of the new section in order.
+         */
+        struct SectionMerge {
+            BasicCANFilter & filter;
+            FilterSection section;
+            const FilterOperation * operation;  //Next operation to merge
+            const FilterOperation * end;        //Past the last operation
+            MaskBlocks * blocks;                //Ids to insert, if not operations
+            unsigned short live;                //Next live item
+            unsigned short liveCount;
+            FilterEntry liveEntry;              //Next of the live and copied items
+            bool haveLive;
+            FilterEntry tableEntry;
+            bool haveTable;
+            unsigned short copy;                //Next item of the copied controller
+            FilterEntry copyEntry;
+            bool haveCopy;
+            bool fromCopy;                      //If liveEntry is a copied item
+            FilterEntry previous;
+            bool started;
+            unsigned short missing;             //Deletes with nothing to delete
+            int replaced;                       //Controller whose live items are dropped, or -1
+            int copied;                         //Controller whose live items are also added
+                                                //as the replaced one's, or -1
+
+            SectionMerge(BasicCANFilter & table, FilterSection s, const FilterOperation * first,
+                         const FilterOperation * last, MaskBlocks * mask = 0, int replace = -1, int copyFrom = -1)
+                : filter(table), section(s), operation(first), end(last), live(0), liveCount(table.sectionCount(s)),
+                  copy(0), started(false), missing(0), replaced(replace), copied(copyFrom) {
+                blocks = (mask && mask->section() == s) ? mask : 0;
+                if (copied >= 0) {
+                    //The copied controller's items are all together
+                    uint32_t lowest = static_cast<uint32_t>(copied) << (extendedSection() ? 29 : 13);
+                    copy = filter.findPosition(section, { lowest, lowest });
+                }
+                readTable();
+                readCopy();
+                pickLive();
+            }
+
+            bool extendedSection() const {
+                return section == FilterSection::extended || section == FilterSection::extendedGroup;
+            }
+
+            /**
+             * Read the next item of the table, skipping disabled ones and the
+             * ones of a controller being replaced. Rebuilding the table is
+             * what compacts disabled items out.
+             */
+            void readTable() {
+                haveTable = false;
+                while (live < liveCount) {
+                    tableEntry = filter.readEntry(section, live);
+                    if (!detail::isDisabled(section, tableEntry)
+                        && (replaced < 0 || detail::entryController(section, tableEntry) != (unsigned)replaced)) {
+                        haveTable = true;
+                        return;
+                    }
+                    live++;
+                }
+            }
+
+            /**
+             * Read the next enabled item of the copied controller, moved onto
+             * the replaced controller.
+             */
+            void readCopy() {
+                haveCopy = false;
+                if (copied < 0)
+                    return;
+
+                unsigned shift = extendedSection() ? 29 : 13;
+                uint32_t controller = static_cast<uint32_t>(0x7) << shift;
+                while (copy < liveCount) {
+                    FilterEntry entry = filter.readEntry(section, copy);
+                    if (detail::entryController(section, detail::entryKey(section, entry)) != (unsigned)copied)
+                        return;
+                    if (!detail::isDisabled(section, entry)) {
+                        copyEntry.first = (entry.first & ~controller) | (static_cast<uint32_t>(replaced) << shift);
+                        copyEntry.last = (entry.last & ~controller) | (static_cast<uint32_t>(replaced) << shift);
+                        haveCopy = true;
+                        return;
+                    }
+                    copy++;
+                }
+            }
+
+            /**
+             * Take the lower of the next table and copied items as the next
+             * live item.
+             */
+            void pickLive() {
+                fromCopy = haveCopy && (!haveTable || copyEntry < tableEntry);
+                haveLive = haveTable || haveCopy;
+                if (haveLive)
+                    liveEntry = fromCopy ? copyEntry : tableEntry;
+            }
+
+            void advanceLive() {
+                if (fromCopy) {
+                    copy++;
+                    readCopy();
+                } else {
+                    live++;
+                    readTable();
+                }
+                pickLive();
+            }
+
+            /**
+             * Look at the next staged change without using it up.
+             * @return false if there are none left
+             */
+            bool peekChange(FilterEntry & entry, bool & remove) const {
+                if (blocks) {
+                    remove = false;
+                    return blocks->peek(entry);
+                }
+                if (operation >= end)
+                    return false;
+
+                entry.first = operation->first;
+                entry.last = operation->last;
+                remove = operation->remove;
+                return true;
+            }
+
+            void advanceChange() {
+                if (blocks) {
+                    blocks->advance();
+                } else {
+                    operation++;
+                }
+            }
+
+            /**
+             * Get the next entry of the new section.
+             * @return false once the section is done
+             */
+            bool next(FilterEntry & entry) {
+                FilterEntry change;
+                bool remove;
+                bool haveChange;
+
+                while ((haveChange = peekChange(change, remove)) || haveLive) {
+                    if (haveLive && (!haveChange || liveEntry < change)) {
+                        //Live item with nothing staged for it, keep it
+                        entry = liveEntry;
+                        advanceLive();
+                    } else {
+                        //Staged item, replaces the live one if they match
+                        bool found = false;
+                        entry = change;
+                        advanceChange();
+                        //Takes every copy, including placeholders of disabled
+                        //filters
+                        while (haveLive && liveEntry == change) {
+                            found = true;
+                            advanceLive();
+                        }
+                        if (remove) {
+                            if (!found)
+                                missing++;
+                            continue;
+                        }
+                    }
+
+                    //Drop duplicates that were inserted before
+                    if (started && entry == previous)
+                        continue;
+
+                    previous = entry;
+                    started = true;
+                    return true;
+                }
+
+                return false;
+            }
+        };
+
+        /**
+         * Builds one id type (standard or extended) of the table image from
+         * its single id and group sections, turning the ids into the fewest
+         * words. Single ids grow up from the start of the id type, groups grow
+         * down from the end of the image and are moved into place at the end.
+         */
+        struct RangeCoalescer {
+            BasicCANFilter & filter;
+            uint32_t * image;           //The filter's table image
+            bool extended;
+            unsigned short base;        //Word the single ids start at
+            unsigned short ids;         //Single ids written
+            unsigned short groups;      //Groups written
+            FilterEntry range;          //Range being built
+            bool open;
+            bool full;
+            unsigned short limit;       //Words the whole table may take up
+
+            RangeCoalescer(BasicCANFilter & table, bool ext, unsigned short start)
+                : filter(table), image(table.tableImage), extended(ext), base(start), ids(0), groups(0), open(false),
+                  full(false), limit(table.tableLimit()) {}
+
+            unsigned short idWords() const {
+                return extended ? ids : (ids + 1) / 2;
+            }
+
+            unsigned short groupWords() const {
+                return extended ? groups * 2 : groups;
+            }
+
+            bool sameController(uint32_t a, uint32_t b) const {
+                return extended ? (a >> 29) == (b >> 29) : (a >> 13) == (b >> 13);
+            }
+
+            /**
+             * Add the next range, in order of first id.
+             */
+            void add(const FilterEntry & entry) {
+                if (open && sameController(range.first, entry.first)
+                    && (entry.first <= range.last || entry.first - range.last == 1)) {
+                    //Overlaps or touches the current range, grow it
+                    if (entry.last > range.last)
+                        range.last = entry.last;
+                    return;
+                }
+
+                flush();
+                range = entry;
+                open = true;
+            }
+
+            /**
+             * Write out the current range. A standard id costs half a word and
+             * a group one word, an extended id one word and a group two, so
+             * anything longer than two ids is cheaper as a group.
+             */
+            void flush() {
+                if (!open)
+                    return;
+                open = false;
+
+                if (range.last - range.first >= 2) {
+                    if (base + idWords() + groupWords() + (extended ? 2 : 1) > limit) {
+                        full = true;
+                        return;
+                    }
+                    groups++;
+                    if (extended) {
+                        image[Capacity - (groups * 2)] = range.first;
+                        image[Capacity - (groups * 2) + 1] = range.last;
+                    } else {
+                        image[Capacity - groups] = (range.first << 16) | range.last;
+                    }
+                    return;
+                }
+
+                for (uint32_t id = range.first; ; id++) {
+                    if (base + detail::sectionWords(extended ? FilterSection::extended : FilterSection::standard, ids + 1) + groupWords() > limit) {
+                        full = true;
+                        return;
+                    }
+                    FilterEntry single = { id, id };
+                    filter.writeEntry(extended ? FilterSection::extended : FilterSection::standard, base, ids, single);
+                    ids++;
+                    if (id == range.last)
+                        break;
+                }
+            }
+
+            /**
+             * Move the groups from the end of the image to just after the
+             * single ids, in ascending order.
+             * @return How many words the id type takes up
+             */
+            unsigned short finish() {
+                flush();
+
+                unsigned short words = groupWords();
+                unsigned short stride = extended ? 2 : 1;
+                unsigned short tail = Capacity - words;
+
+                //They were written backwards, so reverse them first
+                for (unsigned short i = 0; i < groups / 2; i++) {
+                    for (unsigned short w = 0; w < stride; w++) {
+                        uint32_t low = image[tail + (i * stride) + w];
+                        image[tail + (i * stride) + w] = image[Capacity - ((i + 1) * stride) + w];
+                        image[Capacity - ((i + 1) * stride) + w] = low;
+                    }
+                }
+
+                //Then slide them down, the destination is never past the source
+                for (unsigned short i = 0; i < words; i++) {
+                    image[base + idWords() + i] = image[tail + i];
+                }
+
+                return idWords() + words;
+            }
+        };
+
+        /**
+         * Count the inserts and deletes it takes to turn the filters of one
+         * controller into a set. Only that controller's part of each section
+         * is read, found with a binary search.
+         * @param entries The set, sanitized for the controller, sorted and
+         *  without duplicates
+         */
+        unsigned short countChanges(CANController SCC, const FilterOperation * entries, unsigned short entryCount) {
+            unsigned short changes = 0;
+            unsigned short next = 0;
+
+            for (uint8_t s = 0; s < 4; s++) {
+                FilterSection section = static_cast<FilterSection>(s);
+                bool extended = (section == FilterSection::extended || section == FilterSection::extendedGroup);
+                uint32_t lowest = static_cast<uint32_t>(SCC) << (extended ? 29 : 13);
+                unsigned short count = sectionCount(section);
+                unsigned short live = findPosition(section, { lowest, lowest });
+
+                while (true) {
+                    bool haveLive = false;
+                    FilterEntry liveEntry;
+                    while (live < count) {
+                        liveEntry = readEntry(section, live);
+                        if (detail::entryController(section, detail::entryKey(section, liveEntry)) != static_cast<unsigned>(SCC))
+                            break;
+                        if (!detail::isDisabled(section, liveEntry)) {
+                            haveLive = true;
+                            break;
+                        }
+                        //Disabled filters leave the table
+                        changes++;
+                        live++;
+                    }
+
+                    bool haveEntry = next < entryCount && entries[next].section == s;
+                    if (!haveLive && !haveEntry)
+                        break;
+
+                    FilterEntry entry = { 0, 0 };
+                    if (haveEntry)
+                        entry = { entries[next].first, entries[next].last };
+
+                    if (haveLive && haveEntry && liveEntry == entry) {
+                        live++;
+                        next++;
+                    } else if (haveLive && (!haveEntry || liveEntry < entry)) {
+                        changes++;
+                        live++;
+                    } else {
+                        changes++;
+                        next++;
+                    }
+                }
+            }
+
+            return changes;
+        }
+
+        /**
+         * Merge operations with the current Look-Up Table into the table
+         * image. The operations get sorted, and only the last one on each
+         * filter is kept.
+         * @param optimize Merge overlapping and adjacent ids and groups, drop
+         *  ids covered by a group, and pick the encoding with the fewest words
+         * @param mask Blocks of a mask filter to insert as well, or null
+         * @param counts How many items end up in each section
+         * @param words How many words of the image are used
+         * @param missing How many deletes had nothing to delete
+         * @param replace Controller whose live filters are all dropped, so
+         *  the operations replace them, or -1
+         * @param copy Controller whose live filters are copied onto replace,
+         *  or -1
+         * @return 0 on success, -1 if the table would not fit
+         */
+        int buildTable(FilterOperation * operations, unsigned short operationCount, bool optimize, MaskBlocks * mask,
+                       unsigned short counts[4], unsigned short & words, unsigned short & missing, int replace = -1,
+                       int copy = -1) {
+            //The image is about to change under any commit written in steps
+            revision++;
+
+            //Put the operations in the same order as the table. Operations on
+            //the same filter stay in the order they were staged.
+            std::sort(operations, operations + operationCount, detail::operationLess);
+
+            //Only the last operation on each filter matters
+            unsigned short kept = 0;
+            for (unsigned short i = 0; i < operationCount; i++) {
+                if (kept > 0
+                    && operations[kept - 1].section == operations[i].section
+                    && operations[kept - 1].first == operations[i].first
+                    && operations[kept - 1].last == operations[i].last) {
+                    operations[kept - 1] = operations[i];
+                } else {
+                    operations[kept++] = operations[i];
+                }
+            }
+
+            //Where each section's operations start
+            const FilterOperation * sectionOps[5];
+            unsigned short op = 0;
+            for (uint8_t s = 0; s < 4; s++) {
+                sectionOps[s] = operations + op;
+                while (op < kept && operations[op].section == s)
+                    op++;
+            }
+            sectionOps[4] = operations + kept;
+
+            unsigned short base = 0;    //Word the current section starts at
+            unsigned short limit = tableLimit();
+            missing = 0;
+
+            if (!optimize) {
+                //Merge each section of the live table with its operations.
+                //Both are sorted, so this is a single pass.
+                for (uint8_t s = 0; s < 4; s++) {
+                    FilterSection section = static_cast<FilterSection>(s);
+                    SectionMerge merge(*this, section, sectionOps[s], sectionOps[s + 1], mask, replace, copy);
+                    FilterEntry entry;
+                    unsigned short count = 0;
+
+                    while (merge.next(entry)) {
+                        //Make sure the new table will fit
+                        if (base + detail::sectionWords(section, count + 1) > limit)
+                            return -1;
+
+                        writeEntry(section, base, count, entry);
+                        count++;
+                    }
+
+                    counts[s] = count;
+                    missing += merge.missing;
+                    base += detail::sectionWords(section, count);
+                }
+
+                words = base;
+
+                return 0;
+            }
+
+            //Walk the single id and group sections of each id type together,
+            //in id order, so overlapping and adjacent ranges can be merged
+            for (uint8_t s = 0; s < 4; s += 2) {
+                SectionMerge ids(*this, static_cast<FilterSection>(s), sectionOps[s], sectionOps[s + 1], mask, replace, copy);
+                SectionMerge groups(*this, static_cast<FilterSection>(s + 1), sectionOps[s + 1], sectionOps[s + 2], mask, replace, copy);
+                RangeCoalescer coalescer(*this, s == 2, base);
+                FilterEntry id;
+                FilterEntry group;
+                bool haveId = ids.next(id);
+                bool haveGroup = groups.next(group);
+
+                while ((haveId || haveGroup) && !coalescer.full) {
+                    if (haveId && (!haveGroup || id.first <= group.first)) {
+                        coalescer.add(id);
+                        haveId = ids.next(id);
+                    } else {
+                        coalescer.add(group);
+                        haveGroup = groups.next(group);
+                    }
+                }
+
+                base += coalescer.finish();
+                if (coalescer.full)
+                    return -1;
+
+                counts[s] = coalescer.ids;
+                counts[s + 1] = coalescer.groups;
+                missing += ids.missing + groups.missing;
+            }
+
+            words = base;
+
+            return 0;
+        }
+
+        /**
+         * Move the FullCAN message objects from word from to word to, in
+         * whichever direction doesn't overwrite them on the way.
+         */
+        void moveObjects(unsigned short from, unsigned short to) {
+            unsigned short words = objectWords();
+
+            if (to > from) {
+                for (unsigned short i = words; i > 0; i--) {
+                    writeWord(to + i - 1, readWord(from + i - 1));
+                }
+            } else if (to < from) {
+                for (unsigned short i = 0; i < words; i++) {
+                    writeWord(to + i, readWord(from + i));
+                }
+            }
+        }
+
+        /**
+         * Write the first words of a table image to the acceptance filter and
+         * point the section registers at it.
+         *
+         * With double buffering, the image goes into the half of the RAM the
+         * live table is not using while the live table keeps filtering. Only
+         * the section registers are then written in bypass. If either table
+         * is larger than half the RAM, it is written in place instead. So is
+         * every table in FullCAN mode, which has the FullCAN section at the
+         * start of the RAM.
+         */
+        void writeTable(const uint32_t * image, unsigned short words, const unsigned short counts[4]) {
+            unsigned short base = spareBase(words);
+
+            if (doubleBuffered && base != Capacity) {
+                //The live table doesn't use these words, keep filtering
+                for (unsigned short i = 0; i < words; i++) {
+                    writeWord(base + i, image[i]);
+                }
+
+                setFilterMode(FilterMode::bypass);
+            } else {
+                base = fullCANWords();
+
+                setFilterMode(FilterMode::bypass);
+
+                //The message objects follow the end of the table. Moving them
+                //first leaves them clear of the image either way.
+                if (fullCANCount > 0)
+                    moveObjects(tableEnd, base + words);
+
+                for (unsigned short i = 0; i < words; i++) {
+                    writeWord(base + i, image[i]);
+                }
+            }
+
+            placeTable(base, counts);
+        }
+
+        /**
+         * Word a table of words words can be written at without touching the
+         * live table, or Capacity if there is none. That is the half of the
+         * RAM the live table is not using, if the table fits in it. Never in
+         * FullCAN mode, which has the FullCAN section at the start of the RAM.
+         */
+        unsigned short spareBase(unsigned short words) {
+            unsigned short base = (tableBase >= Capacity / 2) ? 0 : Capacity / 2;
+
+            if (fullCAN || words > Capacity / 2 || (base < tableEnd && base + words > tableBase))
+                return Capacity;
+
+            return base;
+        }
+
+        /**
+         * Point the section registers at a table written at base, which
+         * returns the filter to operating mode. It must be in bypass already.
+         */
+        void placeTable(unsigned short base, const unsigned short counts[4]) {
+            //Disabled filters don't make it into a rebuilt table
+            for (unsigned short i = 0; i < disabledCount; i++) {
+                disabled[i].placed = false;
+            }
+
+            tableBase = base;
+            stdCANCount = counts[0];
+            stdGrpCANCount = counts[1];
+            extCANCount = counts[2];
+            extGrpCANCount = counts[3];
+            calculateAddresses();
+            assignHandlers();
+        }
+
+        /**
+         * Start writing tableImage in steps with commitStep(). Called right
+         * after the image is built.
+         */
+        void beginCommit(unsigned short words, const unsigned short counts[4]) {
+            unsigned short base = spareBase(words);
+
+            pending.inPlace = (base == Capacity);
+            pending.base = base;
+            pending.words = words;
+            for (uint8_t s = 0; s < 4; s++) {
+                pending.counts[s] = counts[s];
+            }
+
+            pending.done = 0;
+            pending.revision = revision;
+            pending.active = true;
+        }
+
+        /**
+         * Apply operations by rebuilding the table. Used instead of shifting
+         * when double buffering is on.
+         * @return 0 on success, -1 if the table is full, -2 if a deleted
+         *  filter was not found
+         */
+        int applyOperations(FilterOperation * operations, unsigned short count) {
+            unsigned short counts[4];
+            unsigned short words;
+            unsigned short missing;
+
+            if (buildTable(operations, count, false, 0, counts, words, missing) != 0)
+                return -1;
+            if (missing > 0)
+                return -2;
+
+            writeTable(tableImage, words, counts);
+
+            return 0;
+        }
+
+        /**
+         * Apply a single insert or delete by rebuilding the table.
+         */
+        int applyOperation(FilterSection section, bool remove, uint32_t first, uint32_t last) {
+            FilterOperation operation = { first, last, static_cast<uint8_t>(section), remove, 0 };
+            return applyOperations(&operation, 1);
+        }
+
+        /**
+         * Replace one filter with another. Rebuilds the table with double
+         * buffering on, otherwise moves the filter in place.
+         * @return 0 on success, -2 if the old filter was not found
+         */
+        int updateFilter(FilterSection section, const FilterEntry & from, const FilterEntry & to, bool extended) {
+            //Changing a disabled filter enables it
+            if (findDisabled(section, from) >= 0) {
+                bool window = false;
+                int result = enableEntry(section, from, window);
+                if (window)
+                    setFilterMode(FilterMode::operating);
+                if (result != 0)
+                    return result;
+            }
+
+            if (doubleBuffered) {
+                FilterOperation operations[2] = {
+                    { from.first, from.last, static_cast<uint8_t>(section), true, 0 },
+                    { to.first, to.last, static_cast<uint8_t>(section), false, 1 }
+                };
+                return applyOperations(operations, 2);
+            }
+
+            //Placeholders that copy the filter have to go with it
+            if (extended && hasPlaceholder(section, from))
+                compactFilters();
+
+            int position = findEntry(section, from);
+
+            //If the item is not found, don't update anything
+            if (position < 0)
+                return -2;
+            if (from == to)
+                return 0;
+
+            //Sections keep their size, so only one window and no new addresses
+            setFilterMode(FilterMode::bypass);
+            moveEntry(section, position, to, findHandler(extended, to));
+            setFilterMode(FilterMode::operating);
+
+            return 0;
+        }
+
+        /**
+         * Make sure words more words fit in the table, compacting disabled
+         * filters out of it if they don't. A table double buffering left in
+         * the upper half of the RAM is moved to the start of it.
+         */
+        bool makeRoom(unsigned short words) {
+            if (tableEnd + objectWords() + words <= Capacity)
+                return true;
+
+            compactFilters();
+
+            if (tableEnd + objectWords() + words <= Capacity)
+                return true;
+            if (tableEnd - tableBase + words > tableLimit())
+                return false;
+
+            //Only full because of where it sits
+            unsigned short counts[4];
+            unsigned short size;
+            unsigned short missing;
+
+            if (buildTable(0, 0, false, 0, counts, size, missing) != 0)
+                return false;
+
+            writeTable(tableImage, size, counts);
+
+            return tableEnd + objectWords() + words <= Capacity;
+        }
+
+        /**
+         * Read item index of the FullCAN section, which starts the RAM.
+         */
+        uint32_t readFullCAN(unsigned short index) {
+            uint32_t word = readWord(index / 2);
+            //Even items are in the MSB, odd items in the LSB
+            return (index % 2 == 0) ? (word >> 16) : (word & 0x0000FFFF);
+        }
+
+        /**
+         * Binary search the FullCAN section for the first id that doesn't
+         * sort before mask.
+         */
+        unsigned short findFullCAN(uint32_t mask) {
+            unsigned short low = 0;
+            unsigned short high = fullCANCount;
+
+            while (low < high) {
+                unsigned short middle = (low + high) / 2;
+                if ((readFullCAN(middle) & ~detail::stdDisable) < mask) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            return low;
+        }
+
+        /**
+         * Move the message objects from position up by one object, and clear
+         * the one at position for a new FullCAN id.
+         * @param start Word the objects start at
+         * @param count Number of FullCAN ids before the insert
+         */
+        void openObject(unsigned short start, unsigned short position, unsigned short count) {
+            for (unsigned short i = count * 3; i > position * 3; i--) {
+                writeWord(start + i - 1 + 3, readWord(start + i - 1));
+            }
+            for (unsigned short i = 0; i < 3; i++) {
+                writeWord(start + (position * 3) + i, 0);
+            }
+        }
+
+        /**
+         * Move the message objects after position down by one object, and
+         * clear the last one.
+         * @param start Word the objects start at
+         * @param count Number of FullCAN ids before the delete
+         */
+        void closeObject(unsigned short start, unsigned short position, unsigned short count) {
+            for (unsigned short i = (position + 1) * 3; i < count * 3; i++) {
+                writeWord(start + i - 3, readWord(start + i));
+            }
+            for (unsigned short i = 0; i < 3; i++) {
+                writeWord(start + ((count - 1) * 3) + i, 0);
+            }
+        }
+
+        /**
+         * Binary search a single id section for an enabled item of key.
+         */
+        bool holdsId(FilterSection section, uint32_t key) {
+            unsigned short count = sectionCount(section);
+
+            //A disabled copy of the id may sort next to an enabled one
+            for (unsigned short i = findPosition(section, { key, key }); i < count; i++) {
+                FilterEntry entry = readEntry(section, i);
+                if (detail::entryKey(section, entry).first != key)
+                    return false;
+                if (!detail::isDisabled(section, entry))
+                    return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Binary search a group section for the enabled group holding key.
+         * @return Item index of the group, or -1
+         */
+        int findGroup(FilterSection section, uint32_t key) {
+            unsigned short position = findPosition(section, { key, 0xFFFFFFFF });
+            if (position == 0)
+                return -1;
+
+            FilterEntry entry = readEntry(section, position - 1);
+            if (detail::isDisabled(section, entry) || detail::entryKey(section, entry).last < key)
+                return -1;
+
+            return position - 1;
+        }
+    };
+
+    typedef BasicCANFilter<LPCAcceptanceFilter, 512> LPC1768Filter;
+}
+
+#endif
@@ -0,0 +1,314 @@
+/**
+ * Benchmarks of the filter table operations, printed as CSV so runs can be
+ * compared and plotted over time.
+ *
+ * Host, against the simulated acceptance filter:
+ *     g++ -std=c++11 -O2 -DCANFILTER_SIM -DCANFILTER_STATS -DCANFILTER_BENCH \
+ *         CANFilterBench.cpp CANFilter.cpp CANFilterSim.cpp -o bench
+ *
+ * LPC1768: add CANFILTER_STATS and CANFILTER_BENCH to the macros of an mbed
+ * program, and this file provides its main(). Results go out on the serial
+ * console, timed in DWT cycles.
+ *
+ * Nothing here is built unless CANFILTER_BENCH is defined.
+ */
+#ifdef CANFILTER_BENCH
+
+#ifndef CANFILTER_STATS
+#error "CANFilterBench needs CANFILTER_STATS for its counters"
+#endif
+
+#include "CANFilter.h"
+
+#include <stdio.h>
+
+namespace
+{
+    using namespace CANFilter;
+
+    //Table sizes to run every workload at, in words
+    const unsigned short tableSizes[] = { 8, 16, 32, 64, 128, 256, 512 };
+
+#ifdef CANFILTER_SIM
+    const char * const timeUnit = "ns";
+#else
+    const char * const timeUnit = "cycles";
+#endif
+
+    /**
+     * xorshift32, so the host and the target see the same random workloads.
+     */
+    uint32_t randomState = 1;
+    uint32_t nextRandom() {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return randomState;
+    }
+
+    //Words commitStep() may write per step in the stepped workload
+    const unsigned short stepBudget = 16;
+
+    //Ids used by the current run, so random orders have no repeats
+    uint32_t ids[1024];
+
+    /**
+     * Start every run from an empty filter, the same random sequence and
+     * clear counters.
+     */
+    void startRun(bool doubleBuffered) {
+#ifdef CANFILTER_SIM
+        CANFilterSim::reset();
+#endif
+        resetFilter();
+        setDoubleBuffering(doubleBuffered);
+        randomState = 1;
+        resetStats();
+    }
+
+    /**
+     * Fill ids with 0 to count - 1, spread over the 11 bit id space, in random
+     * order.
+     */
+    void shuffleIds(unsigned short count) {
+        for (unsigned short i = 0; i < count; i++) {
+            ids[i] = i * 2;
+        }
+        for (unsigned short i = count; i > 1; i--) {
+            unsigned short j = nextRandom() % i;
+            uint32_t id = ids[i - 1];
+            ids[i - 1] = ids[j];
+            ids[j] = id;
+        }
+    }
+
+    /**
+     * Print one result row. Only the operation the workload is measuring is
+     * counted, so setup doesn't skew it.
+     */
+    void report(const char * workload, bool doubleBuffered, unsigned short words, const OperationStats & op) {
+        FilterStats stats;
+        getStats(stats);
+
+        unsigned long count = op.count ? op.count : 1;
+        printf("%s,%s,%u,%lu,%s,%lu,%lu,%lu,%lu,%lu,%lu\r\n",
+               workload, doubleBuffered ? "double" : "single", words, op.count, timeUnit,
+               op.cycles / count, op.maxCycles, op.ramReads / count, op.ramWrites / count,
+               stats.bypassWindows, stats.maxBypassCycles);
+    }
+
+    /**
+     * Standard filters in ascending, descending or random order. Two fit in a
+     * word.
+     */
+    void bulkInsert(const char * workload, bool doubleBuffered, unsigned short words, int order) {
+        unsigned short count = words * 2;
+        startRun(doubleBuffered);
+        shuffleIds(count);
+
+        for (unsigned short i = 0; i < count; i++) {
+            uint32_t id = (order > 0) ? i * 2 : (order < 0) ? (count - 1 - i) * 2 : ids[i];
+            insertStandardFilter(CANController::CAN1, id);
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report(workload, doubleBuffered, words, stats.insert);
+    }
+
+    /**
+     * The same random filters staged in a transaction and written with one
+     * commit, to compare with inserting them one at a time.
+     */
+    void transactionInsert(bool doubleBuffered, unsigned short words) {
+        static FilterTransaction transaction;
+        unsigned short count = words * 2;
+        startRun(doubleBuffered);
+        shuffleIds(count);
+        transaction.clear();
+
+        for (unsigned short i = 0; i < count; i++) {
+            //Commit whenever the transaction fills up
+            if (transaction.size() == CANFILTER_TRANSACTION_DEPTH)
+                transaction.commit(false);
+            transaction.insertStandardFilter(CANController::CAN1, ids[i]);
+        }
+        transaction.commit(false);
+
+        FilterStats stats;
+        getStats(stats);
+        report("transaction", doubleBuffered, words, stats.commit);
+    }
+
+    /**
+     * The same random filters as transactionInsert(), written by commitStep()
+     * stepBudget words at a time. max_time is the longest step.
+     */
+    void steppedInsert(bool doubleBuffered, unsigned short words) {
+        static FilterTransaction transaction;
+        unsigned short count = words * 2;
+        startRun(doubleBuffered);
+        shuffleIds(count);
+        transaction.clear();
+
+        for (unsigned short i = 0; i <= count; i++) {
+            //Write whenever the transaction fills up, and at the end
+            if (i == count || transaction.size() == CANFILTER_TRANSACTION_DEPTH) {
+                transaction.beginCommit(false);
+                while (commitStep(stepBudget) > 0)
+                    ;
+            }
+            if (i < count)
+                transaction.insertStandardFilter(CANController::CAN1, ids[i]);
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report("stepped", doubleBuffered, words, stats.step);
+    }
+
+    /**
+     * Fill half the table with extended filters, then delete a random one and
+     * insert a new one, words times.
+     */
+    void churn(bool doubleBuffered, unsigned short words) {
+        unsigned short live = words / 2;
+        startRun(doubleBuffered);
+
+        for (unsigned short i = 0; i < live; i++) {
+            ids[i] = nextRandom() & 0x1FFFFFFF;
+            insertExtendedFilter(CANController::CAN1, ids[i]);
+        }
+
+        resetStats();
+        for (unsigned short i = 0; i < words; i++) {
+            unsigned short victim = nextRandom() % live;
+            deleteExtendedFilter(CANController::CAN1, ids[victim]);
+            ids[victim] = nextRandom() & 0x1FFFFFFF;
+            insertExtendedFilter(CANController::CAN1, ids[victim]);
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report("churn-insert", doubleBuffered, words, stats.insert);
+        report("churn-delete", doubleBuffered, words, stats.remove);
+    }
+
+    /**
+     * Fill half the table with extended filters, then move a random one to a
+     * new id, words times.
+     */
+    void updates(bool doubleBuffered, unsigned short words) {
+        unsigned short live = words / 2;
+        startRun(doubleBuffered);
+
+        for (unsigned short i = 0; i < live; i++) {
+            ids[i] = nextRandom() & 0x1FFFFFFF;
+            insertExtendedFilter(CANController::CAN1, ids[i]);
+        }
+
+        resetStats();
+        for (unsigned short i = 0; i < words; i++) {
+            unsigned short victim = nextRandom() % live;
+            uint32_t id = nextRandom() & 0x1FFFFFFF;
+            updateExtendedFilter(CANController::CAN1, ids[victim], id);
+            ids[victim] = id;
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report("update", doubleBuffered, words, stats.update);
+    }
+
+    /**
+     * Fill half the table with extended filters, then disable a random one
+     * and enable it again, words times. Extended filters have no disable bit,
+     * so this is the placeholder path.
+     */
+    void toggles(bool doubleBuffered, unsigned short words) {
+        unsigned short live = words / 2;
+        startRun(doubleBuffered);
+
+        for (unsigned short i = 0; i < live; i++) {
+            ids[i] = nextRandom() & 0x1FFFFFFF;
+            insertExtendedFilter(CANController::CAN1, ids[i]);
+        }
+
+        resetStats();
+        for (unsigned short i = 0; i < words; i++) {
+            unsigned short victim = nextRandom() % live;
+            disableFilter(CANController::CAN1, FilterSection::extended, ids[victim]);
+            enableFilter(CANController::CAN1, FilterSection::extended, ids[victim]);
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report("toggle", doubleBuffered, words, stats.toggle);
+    }
+
+    /**
+     * A table of only ranges, a third of the words standard groups and the
+     * rest extended groups, inserted in random order.
+     */
+    void groups(bool doubleBuffered, unsigned short words) {
+        unsigned short standard = words / 3;
+        unsigned short extended = (words - standard) / 2;
+        startRun(doubleBuffered);
+        shuffleIds(standard > extended ? standard : extended);
+
+        for (unsigned short i = 0; i < standard; i++) {
+            insertStandardGroupFilter(CANController::CAN1, ids[i], ids[i] + 1);
+        }
+        shuffleIds(extended);
+        for (unsigned short i = 0; i < extended; i++) {
+            insertExtendedGroupFilter(CANController::CAN2, ids[i] << 8, (ids[i] << 8) + 0xFF);
+        }
+
+        FilterStats stats;
+        getStats(stats);
+        report("groups", doubleBuffered, words, stats.insert);
+    }
+
+    /**
+     * Random extended filters until an insert fails. The words column is how
+     * far the table got.
+     */
+    void capacity(bool doubleBuffered) {
+        startRun(doubleBuffered);
+
+        while (insertExtendedFilter(CANController::CAN1, nextRandom() & 0x1FFFFFFF) == 0)
+            ;
+
+        FilterStats stats;
+        getStats(stats);
+        report("capacity", doubleBuffered, 512 - stats.freeWords, stats.insert);
+    }
+}
+
+int main() {
+    printf("workload,buffering,words,operations,unit,time_per_op,max_time,ram_reads_per_op,"
+           "ram_writes_per_op,bypass_windows,max_bypass\r\n");
+
+    for (int buffering = 0; buffering < 2; buffering++) {
+        bool doubleBuffered = (buffering == 1);
+
+        for (unsigned i = 0; i < sizeof(tableSizes) / sizeof(tableSizes[0]); i++) {
+            unsigned short words = tableSizes[i];
+            bulkInsert("sequential", doubleBuffered, words, 1);
+            bulkInsert("reverse", doubleBuffered, words, -1);
+            bulkInsert("random", doubleBuffered, words, 0);
+            transactionInsert(doubleBuffered, words);
+            steppedInsert(doubleBuffered, words);
+            churn(doubleBuffered, words);
+            updates(doubleBuffered, words);
+            toggles(doubleBuffered, words);
+            groups(doubleBuffered, words);
+        }
+
+        capacity(doubleBuffered);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,275 @@
+/**
+ * Compiles the messages an ECU receives, from DBC files, into a Look-Up Table
+ * image that loads with one copy.
+ *
+ *     g++ -std=c++11 -O2 -DCANFILTER_SIM -DCANFILTER_DBC \
+ *         CANFilterDbc.cpp CANFilter.cpp CANFilterSim.cpp -o dbcfilter
+ *     ./dbcfilter ECU --can1 body.dbc --can2 chassis.dbc -o BodyFilters.h [--name bodyFilters]
+ *
+ * A message is picked for a bus if any of its signals lists the ECU as a
+ * receiver. The ids are merged with the driver's own optimizing rebuild, in
+ * the simulated acceptance filter, so adjacent ids become groups and the
+ * table takes the fewest words. The header holds the table and its section
+ * addresses:
+ *
+ *     #include "BodyFilters.h"
+ *     bodyFilters::load();
+ *
+ * Nothing here is built unless CANFILTER_DBC is defined.
+ */
+#ifdef CANFILTER_DBC
+
+#ifndef CANFILTER_SIM
+#error "CANFilterDbc is a host tool, build it with CANFILTER_SIM"
+#endif
+
+#include "CANFilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using namespace CANFilter;
+
+    //Frame format flag of DBC message ids
+    const uint32_t dbcExtended = 0x80000000;
+
+    /**
+     * Read a whole file into memory, with a newline at the end.
+     */
+    bool readFile(const char * path, std::vector<char> & data) {
+        FILE * file = fopen(path, "rb");
+        if (!file) {
+            perror(path);
+            return false;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        data.resize(size + 1);
+        bool ok = (size == 0 || fread(&data[0], 1, size, file) == (size_t)size);
+        data[size] = '\n';
+        fclose(file);
+
+        if (!ok)
+            fprintf(stderr, "%s: read failed\n", path);
+        return ok;
+    }
+
+    const char * skipSpaces(const char * p, const char * end) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        return p;
+    }
+
+    /**
+     * If a signal line lists the ECU as a receiver. Receivers follow the
+     * quoted unit, separated by commas.
+     */
+    bool receivedBy(const char * p, const char * end, const std::string & ecu) {
+        const char * quote = static_cast<const char *>(memchr(p, '"', end - p));
+        if (!quote)
+            return false;
+        quote = static_cast<const char *>(memchr(quote + 1, '"', end - (quote + 1)));
+        if (!quote)
+            return false;
+
+        p = quote + 1;
+        while (p < end) {
+            p = skipSpaces(p, end);
+            const char * name = p;
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r')
+                p++;
+            if ((size_t)(p - name) == ecu.size() && memcmp(name, ecu.data(), ecu.size()) == 0)
+                return true;
+            if (p < end)
+                p++;
+        }
+        return false;
+    }
+
+    /**
+     * Stage every message of a DBC file that the ECU receives, committing
+     * whenever the transaction fills up.
+     * @return How many messages were picked, -1 if they don't fit, or -2
+     *  if the file could not be read
+     */
+    long compileDbc(const char * path, const std::string & ecu, CANController SCC, FilterTransaction & transaction) {
+        std::vector<char> data;
+        if (!readFile(path, data))
+            return -2;
+
+        const char * p = &data[0];
+        const char * end = p + data.size();
+        long picked = 0;
+        bool inMessage = false;
+        bool wanted = false;
+        uint32_t id = 0;
+
+        while (p < end) {
+            const char * line = skipSpaces(p, end);
+            const char * lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+            p = lineEnd + 1;
+
+            if (lineEnd - line > 4 && memcmp(line, "BO_ ", 4) == 0) {
+                char * stop;
+                unsigned long raw = strtoul(line + 4, &stop, 10);
+                id = raw & ~dbcExtended;
+                //Pseudo messages, like VECTOR__INDEPENDENT_SIG_MSG, have ids
+                //no frame can carry
+                inMessage = (raw & dbcExtended) ? id <= 0x1FFFFFFF : id <= 0x7FF;
+                wanted = false;
+                if (inMessage)
+                    id |= raw & dbcExtended;
+                continue;
+            }
+
+            if (lineEnd - line > 4 && memcmp(line, "SG_ ", 4) == 0) {
+                if (!inMessage || wanted || !receivedBy(line, lineEnd, ecu))
+                    continue;
+
+                wanted = true;
+                picked++;
+                if (transaction.size() == CANFILTER_TRANSACTION_DEPTH && transaction.commit(true) != 0)
+                    return -1;
+
+                int result = (id & dbcExtended) ? transaction.insertExtendedFilter(SCC, id & ~dbcExtended)
+                                                : transaction.insertStandardFilter(SCC, id);
+                if (result != 0)
+                    return -1;
+                continue;
+            }
+
+            //Anything else ends the signals of a message
+            if (line < lineEnd && *line != '\r')
+                inMessage = false;
+        }
+
+        return picked;
+    }
+
+    bool writeHeader(const char * path, const std::string & name, const std::string & ecu, long messages) {
+        FILE * file = fopen(path, "w");
+        if (!file) {
+            perror(path);
+            return false;
+        }
+
+        const CANFilterSim::CANAF & af = CANFilterSim::canaf;
+        unsigned words = af.ENDofTable.value / 4;
+        unsigned short counts[4] = {
+            static_cast<unsigned short>((af.SFF_GRP_sa.value - af.SFF_sa.value) / 2),
+            static_cast<unsigned short>((af.EFF_sa.value - af.SFF_GRP_sa.value) / 4),
+            static_cast<unsigned short>((af.EFF_GRP_sa.value - af.EFF_sa.value) / 4),
+            static_cast<unsigned short>((af.ENDofTable.value - af.EFF_GRP_sa.value) / 8)
+        };
+        //An odd number of standard ids leaves a padding entry in the last word
+        if (counts[0] > 0 && (CANFilterSim::canafRam.mask[(af.SFF_GRP_sa.value / 4) - 1].value & 0xFFFF) == 0xFFFF)
+            counts[0]--;
+
+        std::string guard = name;
+        for (size_t i = 0; i < guard.size(); i++) {
+            guard[i] = (guard[i] >= 'a' && guard[i] <= 'z') ? guard[i] - 'a' + 'A' : guard[i];
+        }
+
+        fprintf(file, "//Generated by CANFilterDbc for %s, %ld messages. Do not edit.\n", ecu.c_str(), messages);
+        fprintf(file, "#ifndef %s_H\n#define %s_H\n\n#include \"CANFilter.h\"\n\n", guard.c_str(), guard.c_str());
+        fprintf(file, "namespace %s {\n", name.c_str());
+        fprintf(file, "    const unsigned short words = %u;\n\n", words);
+        fprintf(file, "    //Items in each FilterSection\n");
+        fprintf(file, "    const unsigned short counts[4] = { %u, %u, %u, %u };\n\n", counts[0], counts[1], counts[2], counts[3]);
+        fprintf(file, "    //Section addresses in bytes, the same as the LPC_CANAF registers\n");
+        fprintf(file, "    const uint32_t SFF_sa     = 0x%03X;\n", af.SFF_sa.value);
+        fprintf(file, "    const uint32_t SFF_GRP_sa = 0x%03X;\n", af.SFF_GRP_sa.value);
+        fprintf(file, "    const uint32_t EFF_sa     = 0x%03X;\n", af.EFF_sa.value);
+        fprintf(file, "    const uint32_t EFF_GRP_sa = 0x%03X;\n", af.EFF_GRP_sa.value);
+        fprintf(file, "    const uint32_t ENDofTable = 0x%03X;\n\n", af.ENDofTable.value);
+        fprintf(file, "    const uint32_t table[%u] = {", words > 0 ? words : 1);
+        for (unsigned i = 0; i < words; i++) {
+            fprintf(file, "%s%s0x%08X", (i > 0) ? "," : "", (i % 6 == 0) ? "\n        " : " ",
+                    CANFilterSim::canafRam.mask[i].value);
+        }
+        fprintf(file, "%s\n    };\n\n", words > 0 ? "" : "\n        0");
+        fprintf(file, "    /**\n     * Replace the Look-Up Table with this one, in one copy.\n     */\n");
+        fprintf(file, "    inline int load() {\n        return CANFilter::loadStaticTable(table, words, counts);\n    }\n");
+        fprintf(file, "}\n\n#endif\n");
+
+        bool ok = (ferror(file) == 0);
+        if (fclose(file) != 0 || !ok) {
+            fprintf(stderr, "%s: write failed\n", path);
+            return false;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s ECU [--can1 file.dbc]... [--can2 file.dbc]... -o header.h [--name namespace]\n", argv[0]);
+        return 2;
+    }
+
+    std::string ecu = argv[1];
+    std::string name = "dbcFilters";
+    const char * output = 0;
+    std::vector<const char *> files[2];
+
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s: %s needs a value\n", argv[0], argv[i]);
+            return 2;
+        }
+        if (strcmp(argv[i], "--can1") == 0) {
+            files[0].push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--can2") == 0) {
+            files[1].push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--name") == 0) {
+            name = argv[++i];
+        } else {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+            return 2;
+        }
+    }
+    if (!output) {
+        fprintf(stderr, "%s: no output header, use -o\n", argv[0]);
+        return 2;
+    }
+
+    CANFilterSim::reset();
+    resetFilter();
+
+    static FilterTransaction transaction;
+    long messages = 0;
+    for (int bus = 0; bus < 2; bus++) {
+        for (size_t f = 0; f < files[bus].size(); f++) {
+            long picked = compileDbc(files[bus][f], ecu, static_cast<CANController>(bus), transaction);
+            if (picked == -2)
+                return 1;
+            if (picked < 0) {
+                fprintf(stderr, "%s: the messages %s receives don't fit in the acceptance filter\n", files[bus][f], ecu.c_str());
+                return 1;
+            }
+            messages += picked;
+        }
+    }
+    if (transaction.commit(true) != 0) {
+        fprintf(stderr, "%s: the messages %s receives don't fit in the acceptance filter\n", argv[0], ecu.c_str());
+        return 1;
+    }
+
+    if (!writeHeader(output, name, ecu, messages))
+        return 1;
+
+    printf("%s: %ld messages in %u words\n", output, messages, CANFilterSim::canaf.ENDofTable.value / 4);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,534 @@
+/**
+ * Replays recorded CAN bus logs through a filter configuration, on the host,
+ * to see what it would let through before it goes out to real hardware.
+ *
+ *     g++ -std=c++11 -O2 -DCANFILTER_SIM -DCANFILTER_REPLAY \
+ *         CANFilterReplay.cpp CANFilter.cpp CANFilterSim.cpp -o replay
+ *     ./replay filters.txt trace.log [--isr-cycles N] [--clock HZ]
+ *
+ * The filters are inserted with the driver itself, into the simulated
+ * acceptance filter, so the table is packed exactly the way the LPC1768 would
+ * see it. Frames are then looked up the same way the hardware searches it.
+ *
+ * The filter file has one filter per line, '#' starts a comment:
+ *
+ *     std      CAN1 0x100
+ *     stdgroup CAN1 0x200 0x2FF
+ *     ext      CAN2 0x18FEF100
+ *     extgroup CAN2 0x18FF0000 0x18FFFFFF
+ *     handler  CAN1 std 0x100 0x1FF    # ids the application handles
+ *
+ * Logs can be candump files, "(time) can0 123#DEADBEEF", or Vector ASC
+ * files. can0 and channel 1 are CAN1, can1 and channel 2 are CAN2. BLF logs
+ * have to be converted to ASC first, with python-can's can.logconvert for
+ * instance.
+ *
+ * Logs are memory mapped and parsed in place, so multi-GB traces are not
+ * copied. Nothing here is built unless CANFILTER_REPLAY is defined.
+ */
+#ifdef CANFILTER_REPLAY
+
+#ifndef CANFILTER_SIM
+#error "CANFilterReplay is a host tool, build it with CANFILTER_SIM"
+#endif
+
+#include "CANFilter.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    using namespace CANFilter;
+
+    //Accepted frames are counted in buckets this long to find the peak rate
+    const double burstWindow = 0.010;
+
+    /**
+     * One frame of a log.
+     */
+    struct Frame {
+        double time;
+        unsigned controller;    //0 for CAN1
+        uint32_t id;
+        bool extended;
+    };
+
+    /**
+     * What the filter does with one id: the ID Index the hardware would
+     * report, or -1 if it is rejected, and if dispatch() would handle it.
+     */
+    struct Verdict {
+        short index;
+        bool handled;
+    };
+
+    /**
+     * A snapshot of the Look-Up Table the driver built, with every id looked
+     * up at most once. Standard ids are a flat table, extended ids are cached
+     * as they are seen, since logs repeat the same few ids.
+     */
+    class Model {
+    public:
+        void load() {
+            for (unsigned short i = 0; i < CANFilterSim::ramWords; i++) {
+                ram[i] = CANFilterSim::canafRam.mask[i].value;
+            }
+            layout.SFF_sa = CANFilterSim::canaf.SFF_sa.value;
+            layout.SFF_GRP_sa = CANFilterSim::canaf.SFF_GRP_sa.value;
+            layout.EFF_sa = CANFilterSim::canaf.EFF_sa.value;
+            layout.EFF_GRP_sa = CANFilterSim::canaf.EFF_GRP_sa.value;
+            layout.ENDofTable = CANFilterSim::canaf.ENDofTable.value;
+
+            for (unsigned controller = 0; controller < 2; controller++) {
+                for (uint32_t id = 0; id < 2048; id++) {
+                    standard[controller][id] = search(controller, id, false);
+                }
+            }
+        }
+
+        const Verdict & lookup(unsigned controller, uint32_t id, bool extended) {
+            if (!extended)
+                return standard[controller][id & 0x7FF];
+
+            uint32_t key = (controller << 29) | (id & 0x1FFFFFFF);
+            std::unordered_map<uint32_t, Verdict>::iterator cached = extendedCache.find(key);
+            if (cached != extendedCache.end())
+                return cached->second;
+            return extendedCache[key] = search(controller, id, true);
+        }
+
+        /**
+         * Describe the entry at an ID Index, the way it was inserted.
+         */
+        void describe(short index, char * text, size_t size) const {
+            uint32_t address;
+            if ((uint32_t)index * 2 < layout.EFF_sa) {
+                address = index * 2;
+                uint32_t word = ram[address / 4];
+                uint32_t entry = (address % 4 == 0) ? (word >> 16) : (word & 0xFFFF);
+                if (address < layout.SFF_GRP_sa) {
+                    snprintf(text, size, "std CAN%u 0x%03X", (entry >> 13) + 1, entry & 0x7FF);
+                } else {
+                    uint32_t end = word & 0xFFFF;
+                    snprintf(text, size, "stdgroup CAN%u 0x%03X 0x%03X", (entry >> 13) + 1, entry & 0x7FF, end & 0x7FF);
+                }
+                return;
+            }
+
+            address = layout.EFF_sa + (index - (layout.EFF_sa / 2)) * 4;
+            uint32_t entry = ram[address / 4];
+            if (address < layout.EFF_GRP_sa) {
+                snprintf(text, size, "ext CAN%u 0x%08X", (entry >> 29) + 1, entry & 0x1FFFFFFF);
+            } else {
+                uint32_t end = ram[(address / 4) + 1];
+                snprintf(text, size, "extgroup CAN%u 0x%08X 0x%08X", (entry >> 29) + 1, entry & 0x1FFFFFFF, end & 0x1FFFFFFF);
+            }
+        }
+
+    private:
+        Verdict search(unsigned controller, uint32_t id, bool extended) const {
+            CANFilterSim::LookupResult result = CANFilterSim::lookup(ram, layout, controller, id, extended);
+            Verdict verdict = { -1, false };
+            if (result.accepted) {
+                verdict.index = result.index;
+                verdict.handled = dispatch(result.index, 0);
+            }
+            return verdict;
+        }
+
+        uint32_t ram[CANFilterSim::ramWords];
+        CANFilterSim::TableLayout layout;
+        Verdict standard[2][2048];
+        std::unordered_map<uint32_t, Verdict> extendedCache;
+    };
+
+    void handled(void *) {}
+
+    bool parseController(const char * name, CANController & SCC) {
+        if (strcmp(name, "CAN1") == 0) {
+            SCC = CANController::CAN1;
+        } else if (strcmp(name, "CAN2") == 0) {
+            SCC = CANController::CAN2;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Read the filter file and build the table with the driver.
+     * @return 0 on success, -1 after printing what is wrong
+     */
+    int loadFilters(const char * path) {
+        FILE * file = fopen(path, "r");
+        if (!file) {
+            perror(path);
+            return -1;
+        }
+
+        static FilterSet sets[2];
+        char line[256];
+        unsigned number = 0;
+        int result = 0;
+
+        while (result == 0 && fgets(line, sizeof(line), file)) {
+            number++;
+            char * comment = strchr(line, '#');
+            if (comment)
+                *comment = 0;
+
+            char kind[16];
+            char controller[8];
+            char type[8];
+            int start;      //Ids are at most 29 bits, and %i takes 0x
+            int end;
+            int fields = sscanf(line, "%15s %7s", kind, controller);
+            if (fields <= 0)
+                continue;
+
+            CANController SCC;
+            if (fields < 2 || !parseController(controller, SCC)) {
+                fprintf(stderr, "%s:%u: expected a filter and CAN1 or CAN2\n", path, number);
+                result = -1;
+                break;
+            }
+            FilterSet & set = sets[static_cast<int>(SCC)];
+
+            if (strcmp(kind, "handler") == 0) {
+                fields = sscanf(line, "%*s %*s %7s %i %i", type, &start, &end);
+                if (fields < 2) {
+                    fprintf(stderr, "%s:%u: expected handler CANx std|ext start [end]\n", path, number);
+                    result = -1;
+                } else {
+                    result = registerHandler(SCC, start, fields == 3 ? end : start, strcmp(type, "ext") == 0, handled);
+                }
+                continue;
+            }
+
+            fields = sscanf(line, "%*s %*s %i %i", &start, &end);
+            if (fields < 1) {
+                fprintf(stderr, "%s:%u: missing id\n", path, number);
+                result = -1;
+            } else if (strcmp(kind, "std") == 0) {
+                result = set.insertStandardFilter(start);
+            } else if (strcmp(kind, "stdgroup") == 0 && fields == 2) {
+                result = set.insertStandardGroupFilter(start, end);
+            } else if (strcmp(kind, "ext") == 0) {
+                result = set.insertExtendedFilter(start);
+            } else if (strcmp(kind, "extgroup") == 0 && fields == 2) {
+                result = set.insertExtendedGroupFilter(start, end);
+            } else {
+                fprintf(stderr, "%s:%u: unknown filter '%s'\n", path, number, kind);
+                result = -1;
+            }
+        }
+        fclose(file);
+
+        if (result != 0)
+            return -1;
+
+        for (int controller = 0; controller < 2; controller++) {
+            if (applyFilterSet(static_cast<CANController>(controller), sets[controller]) < 0) {
+                fprintf(stderr, "%s: the filters don't fit in the acceptance filter RAM\n", path);
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Parses frames out of a mapped log without copying it. Lines that aren't
+     * frames, like headers and error frames, are skipped.
+     */
+    class LogReader {
+    public:
+        LogReader(const char * data, size_t size) : position(data), end(data + size) {}
+
+        bool next(Frame & frame) {
+            while (position < end) {
+                const char * line = position;
+                const char * lineEnd = static_cast<const char *>(memchr(position, '\n', end - position));
+                if (!lineEnd)
+                    lineEnd = end;
+                position = lineEnd + 1;
+
+                if (parseCandump(line, lineEnd, frame) || parseAsc(line, lineEnd, frame))
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        static const char * skipSpaces(const char * p, const char * end) {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            return p;
+        }
+
+        /**
+         * Hex digits up to the first non hex character.
+         * @return Past the last digit, or null if there were none
+         */
+        static const char * parseHex(const char * p, const char * end, uint32_t & value) {
+            const char * start = p;
+            value = 0;
+            while (p < end) {
+                char c = *p;
+                unsigned digit;
+                if (c >= '0' && c <= '9') {
+                    digit = c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                    digit = c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                    digit = c - 'A' + 10;
+                } else {
+                    break;
+                }
+                value = (value << 4) | digit;
+                p++;
+            }
+            return p == start ? 0 : p;
+        }
+
+        /**
+         * Seconds, with an optional fraction.
+         * @return Past the last digit, or null if there were none
+         */
+        static const char * parseTime(const char * p, const char * end, double & time) {
+            const char * start = p;
+            double value = 0;
+            while (p < end && *p >= '0' && *p <= '9')
+                value = (value * 10) + (*p++ - '0');
+            if (p < end && *p == '.') {
+                double scale = 0.1;
+                for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+                    value += (*p - '0') * scale;
+                    scale *= 0.1;
+                }
+            }
+            time = value;
+            return p == start ? 0 : p;
+        }
+
+        /**
+         * candump -l: "(1436509052.249713) can0 123#DEADBEEF"
+         */
+        static bool parseCandump(const char * p, const char * end, Frame & frame) {
+            p = skipSpaces(p, end);
+            if (p >= end || *p != '(')
+                return false;
+            p = parseTime(p + 1, end, frame.time);
+            if (!p || p >= end || *p != ')')
+                return false;
+            p = skipSpaces(p + 1, end);
+
+            //Interface name, ending in its number
+            const char * name = p;
+            while (p < end && *p != ' ' && *p != '\t')
+                p++;
+            if (p == name || p[-1] < '0' || p[-1] > '1')
+                return false;
+            frame.controller = p[-1] - '0';
+
+            p = skipSpaces(p, end);
+            const char * id = p;
+            p = parseHex(p, end, frame.id);
+            if (!p || p >= end || *p != '#')
+                return false;
+            frame.extended = (p - id) > 3;
+
+            return true;
+        }
+
+        /**
+         * Vector ASC: "   0.002000 1  18FEF100x       Rx   d 8 ..."
+         */
+        static bool parseAsc(const char * p, const char * end, Frame & frame) {
+            p = skipSpaces(p, end);
+            if (p >= end || *p < '0' || *p > '9')
+                return false;
+            p = parseTime(p, end, frame.time);
+            if (!p)
+                return false;
+            p = skipSpaces(p, end);
+
+            if (p >= end || *p < '1' || *p > '2')
+                return false;
+            frame.controller = *p - '1';
+            p = skipSpaces(p + 1, end);
+
+            p = parseHex(p, end, frame.id);
+            if (!p)
+                return false;
+            frame.extended = (p < end && *p == 'x');
+            if (frame.extended)
+                p++;
+
+            //Only data and remote frames, not statistics or error lines
+            p = skipSpaces(p, end);
+            return end - p >= 2 && ((p[0] == 'R' && p[1] == 'x') || (p[0] == 'T' && p[1] == 'x'));
+        }
+
+        const char * position;
+        const char * end;
+    };
+
+    /**
+     * An accepted id that no handler takes, and how often it was seen.
+     */
+    struct Unhandled {
+        unsigned controller;
+        uint32_t id;
+        bool extended;
+        unsigned long frames;
+    };
+
+    bool moreFrames(const Unhandled & a, const Unhandled & b) {
+        return a.frames > b.frames;
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s filters.txt trace.log [--isr-cycles N] [--clock HZ]\n", argv[0]);
+        return 2;
+    }
+
+    //Cost of the receive interrupt, to estimate the load of accepted frames
+    double isrCycles = 1000;
+    double clock = 96000000;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--isr-cycles") == 0) {
+            isrCycles = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--clock") == 0) {
+            clock = atof(argv[i + 1]);
+        }
+    }
+
+    CANFilterSim::reset();
+    resetFilter();
+    if (loadFilters(argv[1]) != 0)
+        return 1;
+
+    static Model model;
+    model.load();
+
+    int fd = open(argv[2], O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    size_t size = info.st_size;
+    const char * data = 0;
+    if (size > 0) {
+        void * mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror(argv[2]);
+            return 1;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapped);
+    }
+
+    unsigned long frames[2] = { 0, 0 };
+    unsigned long accepted[2] = { 0, 0 };
+    unsigned long ruleHits[CANFilterSim::ramWords * 2] = {};
+    std::unordered_map<uint32_t, Unhandled> unhandled;
+    double first = 0;
+    double last = 0;
+    double bucketStart = 0;
+    unsigned long bucket[2] = { 0, 0 };
+    unsigned long peak[2] = { 0, 0 };
+
+    LogReader reader(data, size);
+    Frame frame;
+    bool started = false;
+    while (reader.next(frame)) {
+        if (!started) {
+            first = bucketStart = frame.time;
+            started = true;
+        }
+        last = frame.time;
+
+        //Close the buckets this frame has moved past
+        if (frame.time - bucketStart >= burstWindow) {
+            for (int c = 0; c < 2; c++) {
+                peak[c] = std::max(peak[c], bucket[c]);
+                bucket[c] = 0;
+            }
+            bucketStart += burstWindow * (unsigned long)((frame.time - bucketStart) / burstWindow);
+        }
+
+        frames[frame.controller]++;
+        const Verdict & verdict = model.lookup(frame.controller, frame.id, frame.extended);
+        if (verdict.index < 0)
+            continue;
+
+        accepted[frame.controller]++;
+        bucket[frame.controller]++;
+        ruleHits[verdict.index]++;
+
+        if (!verdict.handled) {
+            uint32_t key = (frame.controller << 30) | (frame.extended ? 0x20000000 : 0) | frame.id;
+            Unhandled & entry = unhandled[key];
+            entry.controller = frame.controller;
+            entry.id = frame.id;
+            entry.extended = frame.extended;
+            entry.frames++;
+        }
+    }
+    for (int c = 0; c < 2; c++) {
+        peak[c] = std::max(peak[c], bucket[c]);
+    }
+
+    double duration = last > first ? last - first : 0;
+    printf("frames %lu over %.3f s\n", frames[0] + frames[1], duration);
+    for (int c = 0; c < 2; c++) {
+        double rate = duration > 0 ? accepted[c] / duration : 0;
+        double peakRate = peak[c] / burstWindow;
+        printf("CAN%d: %lu of %lu frames accepted, %.1f frames/s, peak %.1f frames/s, "
+               "ISR load %.2f%% average %.2f%% peak\n",
+               c + 1, accepted[c], frames[c], rate, peakRate,
+               100.0 * rate * isrCycles / clock, 100.0 * peakRate * isrCycles / clock);
+    }
+
+    printf("\nframes accepted by each filter\n");
+    for (unsigned short i = 0; i < CANFilterSim::ramWords * 2; i++) {
+        if (ruleHits[i] == 0)
+            continue;
+        char text[64];
+        model.describe(i, text, sizeof(text));
+        printf("%10lu  %s\n", ruleHits[i], text);
+    }
+
+    std::vector<Unhandled> ids;
+    for (std::unordered_map<uint32_t, Unhandled>::const_iterator i = unhandled.begin(); i != unhandled.end(); ++i) {
+        ids.push_back(i->second);
+    }
+    std::sort(ids.begin(), ids.end(), moreFrames);
+    printf("\naccepted ids with no handler: %zu\n", ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        printf("%10lu  CAN%u %s 0x%0*X\n", ids[i].frames, ids[i].controller + 1,
+               ids[i].extended ? "ext" : "std", ids[i].extended ? 8 : 3, ids[i].id);
+    }
+
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    close(fd);
+
+    return 0;
+}
+
+#endif
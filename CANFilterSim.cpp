@@ -0,0 +1,443 @@
+#include "CANFilterSim.h"
+
+#include <string.h>
+
+namespace CANFilterSim
+{
+    CANAF canaf;
+    CANAF_RAM canafRam;
+    Counters counters;
+    uint8_t flash[flashSize];
+
+    /* Private variables/functions */
+    namespace
+    {
+        //Accesses made in the current bypass window
+        unsigned long currentBypass = 0;
+
+        //Standard entries have a disable bit next to the controller bits
+        const uint32_t stdDisable = 0x00001000;
+        //Bits of a standard entry that take part in the comparison
+        const uint32_t stdKeyBits = 0x0000E7FF;
+
+        /**
+         * If the filter is screening messages, which is the only time the user
+         * manual forbids writes to the table.
+         */
+        bool operating() {
+            return (canaf.AFMR.value & (AccOff | AccBP)) == 0;
+        }
+
+        /**
+         * Count an access to the peripheral towards the current bypass window.
+         */
+        void countAccess() {
+            if (!operating()) {
+                counters.bypassAccesses++;
+                currentBypass++;
+            }
+        }
+
+        /**
+         * Count a write to one of the section registers or the table RAM.
+         * Setting or clearing the disable bit of standard entries is the only
+         * table change allowed in operating mode.
+         */
+        void countTableWrite(uint32_t previous, uint32_t data) {
+            if (operating() && ((previous ^ data) & ~((stdDisable << 16) | stdDisable)) != 0)
+                counters.illegalWrites++;
+        }
+
+        /**
+         * Count a write to a word of the table RAM. Words outside of the table
+         * the filter is searching can be changed at any time.
+         */
+        void countRamWrite(unsigned short index, uint32_t previous, uint32_t data) {
+            uint32_t start = (canaf.AFMR.value & eFCAN) ? 0 : canaf.SFF_sa.value;
+            uint32_t address = index * 4;
+
+            if (address >= start && address < canaf.ENDofTable.value)
+                countTableWrite(previous, data);
+        }
+
+        /**
+         * Convert a byte address of the table to the ID index the hardware
+         * would report for it.
+         */
+        int entryIndex(const TableLayout & layout, uint32_t address) {
+            if (address < layout.EFF_sa)
+                return address / 2;
+            return (layout.EFF_sa / 2) + ((address - layout.EFF_sa) / 4);
+        }
+
+        /**
+         * Read the standard entry at a half word address of the table.
+         */
+        uint32_t readHalf(const uint32_t * ram, uint32_t address) {
+            uint32_t word = ram[address / 4];
+            //The lower address is in the MSB
+            return (address % 4 == 0) ? (word >> 16) : (word & 0x0000FFFF);
+        }
+
+        /**
+         * Binary search a section of standard entries for key. Returns the
+         * address of the match, or -1.
+         */
+        long searchStandard(const uint32_t * ram, uint32_t start, uint32_t end, uint32_t key) {
+            long low = 0;
+            long high = ((long)end - (long)start) / 2 - 1;
+
+            while (low <= high) {
+                long middle = (low + high) / 2;
+                uint32_t entry = readHalf(ram, start + (middle * 2));
+
+                if ((entry & stdKeyBits) < key) {
+                    low = middle + 1;
+                } else if ((entry & stdKeyBits) > key) {
+                    high = middle - 1;
+                } else {
+                    return (entry & stdDisable) ? -1 : (long)(start + (middle * 2));
+                }
+            }
+
+            return -1;
+        }
+
+        /**
+         * Binary search a section of ranges for the one holding key. stride is
+         * the size of one range in bytes. Returns the address of the match,
+         * or -1. Ranges with a lower bound above their upper bound are flagged
+         * in errorAddress.
+         */
+        long searchGroup(const uint32_t * ram, uint32_t start, uint32_t end, uint32_t key, bool standard, uint32_t * errorAddress) {
+            uint32_t stride = standard ? 4 : 8;
+            long low = 0;
+            long high = ((long)end - (long)start) / stride - 1;
+            long found = -1;
+
+            //Find the last range with a lower bound at or below the key
+            while (low <= high) {
+                long middle = (low + high) / 2;
+                uint32_t address = start + (middle * stride);
+                uint32_t lower = standard ? ((ram[address / 4] >> 16) & stdKeyBits) : ram[address / 4];
+
+                if (lower <= key) {
+                    found = middle;
+                    low = middle + 1;
+                } else {
+                    high = middle - 1;
+                }
+            }
+
+            if (found < 0)
+                return -1;
+
+            uint32_t address = start + (found * stride);
+            uint32_t lower;
+            uint32_t upper;
+            bool disabled = false;
+            if (standard) {
+                uint32_t word = ram[address / 4];
+                lower = (word >> 16) & stdKeyBits;
+                upper = word & stdKeyBits;
+                disabled = (word & ((stdDisable << 16) | stdDisable)) != 0;
+            } else {
+                lower = ram[address / 4];
+                upper = ram[(address / 4) + 1];
+            }
+
+            if (lower > upper) {
+                if (errorAddress)
+                    *errorAddress = address;
+                return -1;
+            }
+
+            return (!disabled && key <= upper) ? (long)address : -1;
+        }
+
+        /**
+         * Search the table the same way the hardware does. Standard frames go
+         * through the FullCAN, standard and standard group sections, extended
+         * frames through the extended and extended group sections.
+         */
+        LookupResult search(const uint32_t * ram, const TableLayout & layout, bool fullCAN, unsigned controller, uint32_t id, bool extended, uint32_t * errorAddress) {
+            LookupResult result = { false, -1 };
+            long address = -1;
+
+            //Sections past the end of RAM, or out of order, are empty
+            uint32_t limit = ramWords * 4;
+            uint32_t end = layout.ENDofTable < limit ? layout.ENDofTable : limit;
+            uint32_t effGrp = layout.EFF_GRP_sa < end ? layout.EFF_GRP_sa : end;
+            uint32_t eff = layout.EFF_sa < effGrp ? layout.EFF_sa : effGrp;
+            uint32_t sffGrp = layout.SFF_GRP_sa < eff ? layout.SFF_GRP_sa : eff;
+            uint32_t sff = layout.SFF_sa < sffGrp ? layout.SFF_sa : sffGrp;
+
+            if (extended) {
+                uint32_t key = ((controller & 0x7) << 29) | (id & 0x1FFFFFFF);
+                long low = 0;
+                long high = ((long)effGrp - (long)eff) / 4 - 1;
+
+                while (low <= high && address < 0) {
+                    long middle = (low + high) / 2;
+                    uint32_t entry = ram[(eff / 4) + middle];
+                    if (entry < key) {
+                        low = middle + 1;
+                    } else if (entry > key) {
+                        high = middle - 1;
+                    } else {
+                        address = eff + (middle * 4);
+                    }
+                }
+
+                if (address < 0)
+                    address = searchGroup(ram, effGrp, end, key, false, errorAddress);
+            } else {
+                uint32_t key = ((controller & 0x7) << 13) | (id & 0x000007FF);
+
+                if (fullCAN)
+                    address = searchStandard(ram, 0, sff, key);
+                if (address < 0)
+                    address = searchStandard(ram, sff, sffGrp, key);
+                if (address < 0)
+                    address = searchGroup(ram, sffGrp, eff, key, true, errorAddress);
+            }
+
+            if (address >= 0) {
+                TableLayout clamped = { sff, sffGrp, eff, effGrp, end };
+                result.accepted = true;
+                result.index = entryIndex(clamped, address);
+            }
+
+            return result;
+        }
+    }
+
+    Register::operator uint32_t() const {
+        counters.registerReads++;
+        countAccess();
+        return value;
+    }
+
+    Register & Register::operator=(uint32_t data) {
+        counters.registerWrites++;
+        countAccess();
+        countTableWrite(value, data);
+        value = data;
+        return *this;
+    }
+
+    Register & Register::operator=(const Register & other) {
+        return *this = static_cast<uint32_t>(other);
+    }
+
+    ModeRegister & ModeRegister::operator=(uint32_t data) {
+        bool wasOperating = operating();
+
+        counters.registerWrites++;
+        countAccess();
+        value = data;
+
+        if (wasOperating && !operating()) {
+            //Opening a new window
+            counters.bypassWindows++;
+            currentBypass = 0;
+        } else if (!wasOperating && operating()) {
+            //Closing the window
+            if (currentBypass > counters.longestBypass)
+                counters.longestBypass = currentBypass;
+        }
+
+        return *this;
+    }
+
+    ModeRegister & ModeRegister::operator=(const Register & other) {
+        return *this = static_cast<uint32_t>(other);
+    }
+
+    ErrorAddressRegister::operator uint32_t() const {
+        counters.registerReads++;
+        countAccess();
+        canaf.LUTerr.value = 0;
+        return value;
+    }
+
+    RamWord::operator uint32_t() const {
+        counters.ramReads++;
+        countAccess();
+        return value;
+    }
+
+    RamWord & RamWord::operator=(uint32_t data) {
+        counters.ramWrites++;
+        countAccess();
+        countRamWrite(this - canafRam.mask, value, data);
+        value = data;
+        return *this;
+    }
+
+    RamWord & RamWord::operator=(const RamWord & other) {
+        return *this = static_cast<uint32_t>(other);
+    }
+
+    void reset() {
+        canaf = CANAF();
+        canafRam = CANAF_RAM();
+        //The filter comes out of reset switched off
+        canaf.AFMR.value = AccOff;
+        memset(flash, 0xFF, flashSize);
+        resetCounters();
+    }
+
+    void resetCounters() {
+        counters = Counters();
+        currentBypass = 0;
+    }
+
+    LookupResult lookup(unsigned controller, uint32_t id, bool extended) {
+        LookupResult result = { false, -1 };
+
+        //Bypass accepts everything, off accepts nothing
+        if (canaf.AFMR.value & AccBP) {
+            result.accepted = true;
+            return result;
+        }
+        if (canaf.AFMR.value & AccOff)
+            return result;
+
+        uint32_t ram[ramWords];
+        for (unsigned short i = 0; i < ramWords; i++) {
+            ram[i] = canafRam.mask[i].value;
+        }
+
+        TableLayout layout = {
+            canaf.SFF_sa.value,
+            canaf.SFF_GRP_sa.value,
+            canaf.EFF_sa.value,
+            canaf.EFF_GRP_sa.value,
+            canaf.ENDofTable.value
+        };
+
+        //Anything not word aligned is not a real table address
+        const uint32_t noError = 0xFFFFFFFF;
+        uint32_t errorAddress = noError;
+        bool fullCAN = (canaf.AFMR.value & eFCAN) != 0;
+        result = search(ram, layout, fullCAN, controller, id, extended, &errorAddress);
+
+        //Report table errors through LUTerr like the hardware
+        if (errorAddress != noError) {
+            canaf.LUTerrAd.value = errorAddress;
+            canaf.LUTerr.value = 1;
+        }
+
+        return result;
+    }
+
+    LookupResult lookup(const uint32_t * ram, const TableLayout & layout, unsigned controller, uint32_t id, bool extended) {
+        return search(ram, layout, false, controller, id, extended, 0);
+    }
+
+    bool storeFullCAN(unsigned controller, uint32_t id, bool remote, uint8_t length, const uint8_t * data) {
+        //Bypass and off never store, and neither does the normal mode
+        if ((canaf.AFMR.value & (AccOff | AccBP)) != 0 || (canaf.AFMR.value & eFCAN) == 0)
+            return false;
+
+        uint32_t ram[ramWords];
+        for (unsigned short i = 0; i < ramWords; i++) {
+            ram[i] = canafRam.mask[i].value;
+        }
+
+        uint32_t end = canaf.SFF_sa.value < ramWords * 4 ? canaf.SFF_sa.value : ramWords * 4;
+        uint32_t key = ((controller & 0x7) << 13) | (id & 0x000007FF);
+        long address = searchStandard(ram, 0, end, key);
+        if (address < 0)
+            return false;
+
+        //One object of 3 words for each half word of the FullCAN section
+        uint32_t word = (canaf.ENDofTable.value / 4) + ((address / 2) * 3);
+        if (word + 3 > ramWords)
+            return false;
+
+        uint32_t control = (remote ? 0x40000000 : 0) | ((uint32_t)(length & 0xF) << 16)
+                         | ((controller & 0x7) << 13) | (id & 0x000007FF);
+        uint32_t dataA = 0;
+        uint32_t dataB = 0;
+        for (unsigned short i = 0; i < 4; i++) {
+            dataA |= (uint32_t)data[i] << (i * 8);
+            dataB |= (uint32_t)data[i + 4] << (i * 8);
+        }
+
+        canafRam.mask[word].value = control | 0x01000000;
+        canafRam.mask[word + 1].value = dataA;
+        canafRam.mask[word + 2].value = dataB;
+        canafRam.mask[word].value = control | 0x03000000;
+
+        return true;
+    }
+}
+
+namespace mbed
+{
+    int FlashIAP::init() {
+        return 0;
+    }
+
+    int FlashIAP::deinit() {
+        return 0;
+    }
+
+    int FlashIAP::read(void * buffer, uint32_t addr, uint32_t size) {
+        if (addr > CANFilterSim::flashSize || size > CANFilterSim::flashSize - addr)
+            return -1;
+        memcpy(buffer, CANFilterSim::flash + addr, size);
+        return 0;
+    }
+
+    int FlashIAP::program(const void * buffer, uint32_t addr, uint32_t size) {
+        if (addr % get_page_size() != 0 || size % get_page_size() != 0
+            || addr > CANFilterSim::flashSize || size > CANFilterSim::flashSize - addr)
+            return -1;
+
+        //Programming only clears bits
+        const uint8_t * data = static_cast<const uint8_t *>(buffer);
+        for (uint32_t i = 0; i < size; i++) {
+            CANFilterSim::flash[addr + i] &= data[i];
+        }
+        return 0;
+    }
+
+    int FlashIAP::erase(uint32_t addr, uint32_t size) {
+        uint32_t end = addr + size;
+        if (end > CANFilterSim::flashSize)
+            return -1;
+
+        //Whole sectors only
+        while (addr < end) {
+            uint32_t sector = get_sector_size(addr);
+            if (addr % sector != 0)
+                return -1;
+            memset(CANFilterSim::flash + addr, get_erase_value(), sector);
+            addr += sector;
+        }
+        return 0;
+    }
+
+    uint32_t FlashIAP::get_page_size() const {
+        return 256;
+    }
+
+    uint32_t FlashIAP::get_sector_size(uint32_t addr) const {
+        return addr < 0x10000 ? 0x1000 : 0x8000;
+    }
+
+    uint32_t FlashIAP::get_flash_start() const {
+        return 0;
+    }
+
+    uint32_t FlashIAP::get_flash_size() const {
+        return CANFilterSim::flashSize;
+    }
+
+    uint8_t FlashIAP::get_erase_value() const {
+        return 0xFF;
+    }
+}
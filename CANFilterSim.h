@@ -0,0 +1,216 @@
+#ifndef CANFILTERSIM_H
+#define CANFILTERSIM_H
+
+#include <stdint.h>
+
+/**
+ * Host side simulation of the LPC1768 CAN acceptance filter. Build with
+ * CANFILTER_SIM defined and CANFilter.h will use these register blocks instead
+ * of the ones from "mbed.h", so the driver can be profiled and checked on a
+ * PC. Every access the driver makes is counted.
+ */
+namespace CANFilterSim {
+    /**
+     * Number of words in the acceptance filter RAM.
+     */
+    const unsigned short ramWords = 512;
+
+    /**
+     * Bits of the AFMR register.
+     */
+    const uint32_t AccOff   = 0b001;
+    const uint32_t AccBP    = 0b010;
+    const uint32_t eFCAN    = 0b100;
+
+    /**
+     * Counts of the accesses made to the simulated peripheral.
+     */
+    struct Counters {
+        unsigned long registerReads;    //Reads of the LPC_CANAF registers
+        unsigned long registerWrites;   //Writes to the LPC_CANAF registers
+        unsigned long ramReads;         //Reads of LPC_CANAF_RAM->mask
+        unsigned long ramWrites;        //Writes to LPC_CANAF_RAM->mask
+        unsigned long illegalWrites;    //Writes to the live table in operating mode
+        unsigned long bypassWindows;    //Times the filter left operating mode
+        unsigned long bypassAccesses;   //Accesses made outside of operating mode
+        unsigned long longestBypass;    //Most accesses made in one window
+    };
+
+    /**
+     * A register of the LPC_CANAF block. Reads and writes are counted.
+     */
+    class Register {
+    public:
+        Register() : value(0) {}
+        operator uint32_t() const;
+        Register & operator=(uint32_t data);
+        Register & operator=(const Register & other);
+
+        uint32_t value;
+    };
+
+    /**
+     * The AFMR register. Tracks when the filter leaves operating mode.
+     */
+    class ModeRegister : public Register {
+    public:
+        ModeRegister & operator=(uint32_t data);
+        ModeRegister & operator=(const Register & other);
+    };
+
+    /**
+     * The LUTerrAd register. Reading it clears LUTerr, like the hardware.
+     */
+    class ErrorAddressRegister : public Register {
+    public:
+        operator uint32_t() const;
+    };
+
+    /**
+     * A word of the acceptance filter RAM. Reads and writes are counted.
+     */
+    class RamWord {
+    public:
+        RamWord() : value(0) {}
+        operator uint32_t() const;
+        RamWord & operator=(uint32_t data);
+        RamWord & operator=(const RamWord & other);
+
+        uint32_t value;
+    };
+
+    /**
+     * Same layout as LPC_CANAF_TypeDef.
+     */
+    struct CANAF {
+        ModeRegister AFMR;
+        Register SFF_sa;
+        Register SFF_GRP_sa;
+        Register EFF_sa;
+        Register EFF_GRP_sa;
+        Register ENDofTable;
+        ErrorAddressRegister LUTerrAd;
+        Register LUTerr;
+        Register FCANIE;
+        Register FCANIC0;
+        Register FCANIC1;
+    };
+
+    /**
+     * Same layout as LPC_CANAF_RAM_TypeDef.
+     */
+    struct CANAF_RAM {
+        RamWord mask[ramWords];
+    };
+
+    extern CANAF canaf;
+    extern CANAF_RAM canafRam;
+    extern Counters counters;
+
+    /**
+     * Size of the simulated flash, in bytes.
+     */
+    const uint32_t flashSize = 512 * 1024;
+
+    /**
+     * Contents of the simulated flash, erased by reset().
+     */
+    extern uint8_t flash[flashSize];
+
+    /**
+     * Start and end addresses of the Look-Up Table sections, in bytes, the
+     * same as the LPC_CANAF section registers.
+     */
+    struct TableLayout {
+        uint32_t SFF_sa;
+        uint32_t SFF_GRP_sa;
+        uint32_t EFF_sa;
+        uint32_t EFF_GRP_sa;
+        uint32_t ENDofTable;
+    };
+
+    /**
+     * Result of passing a frame through the acceptance filter.
+     */
+    struct LookupResult {
+        bool accepted;
+        //Index of the matching Look-Up Table entry, as reported in the ID Index
+        //field of CANxRFS. Standard entries are counted as half words, from the
+        //start of the RAM, and extended entries as words. Groups report the
+        //index of their lower bound. -1 if no entry matched.
+        int index;
+    };
+
+    /**
+     * Reset the simulated peripheral to its power on state and clear all
+     * counters.
+     */
+    void reset();
+
+    /**
+     * Clear all counters, leaving the peripheral as it is.
+     */
+    void resetCounters();
+
+    /**
+     * Run a frame through the simulated acceptance filter, following the AFMR
+     * the way the hardware does. These reads are not counted.
+     * @param controller The CAN controller the frame arrived on, 0 for CAN1
+     * @param id The 11 or 29 bit identifier of the frame
+     * @param extended If the frame has an extended identifier
+     */
+    LookupResult lookup(unsigned controller, uint32_t id, bool extended);
+
+    /**
+     * Run a frame through a table image, as if the filter were in operating
+     * mode.
+     * @param ram The acceptance filter RAM image
+     * @param layout The section addresses of the table in the image
+     * @param controller The CAN controller the frame arrived on, 0 for CAN1
+     * @param id The 11 or 29 bit identifier of the frame
+     * @param extended If the frame has an extended identifier
+     */
+    LookupResult lookup(const uint32_t * ram, const TableLayout & layout, unsigned controller, uint32_t id, bool extended);
+
+    /**
+     * Receive a standard frame the way the hardware does in FullCAN mode. If
+     * the id is in the FullCAN section, the frame is stored in its message
+     * object after the end of the table, setting the semaphore bits to 01
+     * while it is written and to 11 once it is done. These accesses are not
+     * counted.
+     * @param controller The CAN controller the frame arrived on, 0 for CAN1
+     * @param id The 11 bit identifier of the frame
+     * @param remote If it is a remote frame
+     * @param length The data length code
+     * @param data 8 bytes of data
+     * @return true if the frame was stored in a message object
+     */
+    bool storeFullCAN(unsigned controller, uint32_t id, bool remote, uint8_t length, const uint8_t * data);
+}
+
+namespace mbed {
+    /**
+     * The on-chip flash of the LPC1768, with the same interface as the
+     * FlashIAP class of mbed. 512KB, 4KB sectors for the first 64KB and 32KB
+     * sectors after that, programmed 256 bytes at a time. Programming can
+     * only clear bits, like the real flash.
+     */
+    class FlashIAP {
+    public:
+        int init();
+        int deinit();
+        int read(void * buffer, uint32_t addr, uint32_t size);
+        int program(const void * buffer, uint32_t addr, uint32_t size);
+        int erase(uint32_t addr, uint32_t size);
+        uint32_t get_page_size() const;
+        uint32_t get_sector_size(uint32_t addr) const;
+        uint32_t get_flash_start() const;
+        uint32_t get_flash_size() const;
+        uint8_t get_erase_value() const;
+    };
+}
+
+#define LPC_CANAF       (&CANFilterSim::canaf)
+#define LPC_CANAF_RAM   (&CANFilterSim::canafRam)
+
+#endif
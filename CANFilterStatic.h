@@ -0,0 +1,231 @@
+#ifndef CANFILTERSTATIC_H
+#define CANFILTERSTATIC_H
+
+#include <stddef.h>
+#include "CANFilter.h"
+
+/**
+ * Look-Up Tables built at compile time. Needs C++14.
+ *
+ *     constexpr CANFilter::StaticFilter filters[] = {
+ *         CANFilter::standardFilter(CANFilter::CANController::CAN1, 0x100),
+ *         CANFilter::extendedGroupFilter(CANFilter::CANController::CAN2, 0x18FF0000, 0x18FFFFFF),
+ *     };
+ *     constexpr auto table = CANFilter::makeStaticTable<CANFilter::staticTableWords(filters)>(filters);
+ *
+ *     CANFilter::loadStaticTable(table);
+ *
+ * The filters are sorted, packed and checked by the compiler, and the table
+ * ends up in flash. A table larger than the acceptance filter RAM, or a group
+ * that ends before it starts, fails to compile.
+ */
+namespace CANFilter {
+    /**
+     * One filter of a static table. Build these with the functions below.
+     */
+    struct StaticFilter {
+        FilterSection section;
+        uint32_t first;     //Sanitized mask, or the start of a group
+        uint32_t last;      //Same as first, or the end of a group
+    };
+
+    constexpr uint32_t staticStdMask(CANController SCC, uint32_t mask) {
+        return (mask & 0x000007FF) | (static_cast<uint32_t>(SCC) << 13);
+    }
+
+    constexpr uint32_t staticExtMask(CANController SCC, uint32_t mask) {
+        return (mask & 0x1FFFFFFF) | (static_cast<uint32_t>(SCC) << 29);
+    }
+
+    /**
+     * A standard filter for a static table.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param mask The filter id that will be whitelisted
+     */
+    constexpr StaticFilter standardFilter(CANController SCC, uint32_t mask) {
+        return { FilterSection::standard, staticStdMask(SCC, mask), staticStdMask(SCC, mask) };
+    }
+    /**
+     * A standard group filter for a static table.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param start The first filter id of the group
+     * @param end The last filter id of the group
+     */
+    constexpr StaticFilter standardGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return { FilterSection::standardGroup, staticStdMask(SCC, start), staticStdMask(SCC, end) };
+    }
+    /**
+     * A extended filter for a static table.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param mask The filter id that will be whitelisted
+     */
+    constexpr StaticFilter extendedFilter(CANController SCC, uint32_t mask) {
+        return { FilterSection::extended, staticExtMask(SCC, mask), staticExtMask(SCC, mask) };
+    }
+    /**
+     * A extended group filter for a static table.
+     * @param SCC Which CAN controller will be affected by this filter
+     * @param start The first filter id of the group
+     * @param end The last filter id of the group
+     */
+    constexpr StaticFilter extendedGroupFilter(CANController SCC, uint32_t start, uint32_t end) {
+        return { FilterSection::extendedGroup, staticExtMask(SCC, start), staticExtMask(SCC, end) };
+    }
+
+    /**
+     * A Look-Up Table image and where its sections start, ready for
+     * loadStaticTable().
+     */
+    template <unsigned short Words>
+    struct StaticTable {
+        static_assert(Words <= 512, "CAN filter table is larger than the acceptance filter RAM");
+
+        uint32_t words[Words > 0 ? Words : 1];
+        unsigned short counts[4];   //Items in each FilterSection
+
+        //Section addresses in bytes, the same as the LPC_CANAF registers
+        uint32_t SFF_sa;
+        uint32_t SFF_GRP_sa;
+        uint32_t EFF_sa;
+        uint32_t EFF_GRP_sa;
+        uint32_t ENDofTable;
+    };
+
+    namespace detail {
+        //Not constexpr, so calling them during constant evaluation is a
+        //compile error that names the problem
+        void staticTableSizeMismatch();
+        void staticGroupEndsBeforeStart();
+
+        constexpr bool staticLess(const StaticFilter & a, const StaticFilter & b) {
+            return a.section != b.section ? a.section < b.section
+                 : a.first != b.first     ? a.first < b.first
+                 : a.last < b.last;
+        }
+
+        constexpr bool staticEqual(const StaticFilter & a, const StaticFilter & b) {
+            return a.section == b.section && a.first == b.first && a.last == b.last;
+        }
+
+        /**
+         * The filters sorted into table order, without duplicates.
+         */
+        template <size_t N>
+        struct SortedFilters {
+            StaticFilter filters[N];
+            size_t count;
+            unsigned short counts[4];
+        };
+
+        template <size_t N>
+        constexpr SortedFilters<N> sortFilters(const StaticFilter (&filters)[N]) {
+            SortedFilters<N> sorted = {};
+
+            //Insertion sort, dropping duplicates as they are found
+            for (size_t i = 0; i < N; i++) {
+                StaticFilter filter = filters[i];
+                if (filter.first > filter.last)
+                    staticGroupEndsBeforeStart();
+
+                size_t index = sorted.count;
+                while (index > 0 && staticLess(filter, sorted.filters[index - 1]))
+                    index--;
+                if (index > 0 && staticEqual(filter, sorted.filters[index - 1]))
+                    continue;
+
+                for (size_t j = sorted.count; j > index; j--) {
+                    sorted.filters[j] = sorted.filters[j - 1];
+                }
+                sorted.filters[index] = filter;
+                sorted.count++;
+                sorted.counts[static_cast<int>(filter.section)]++;
+            }
+
+            return sorted;
+        }
+
+        constexpr unsigned long staticWords(const unsigned short counts[4]) {
+            return ((counts[0] + 1) / 2) + counts[1] + counts[2] + (counts[3] * 2);
+        }
+    }
+
+    /**
+     * How many words of the acceptance filter RAM a set of filters takes up.
+     * Use it as the size of makeStaticTable().
+     */
+    template <size_t N>
+    constexpr unsigned long staticTableWords(const StaticFilter (&filters)[N]) {
+        return detail::staticWords(detail::sortFilters(filters).counts);
+    }
+
+    /**
+     * Sort and pack a set of filters into a Look-Up Table image.
+     * @tparam Words staticTableWords() of the same filters
+     */
+    template <unsigned short Words, size_t N>
+    constexpr StaticTable<Words> makeStaticTable(const StaticFilter (&filters)[N]) {
+        detail::SortedFilters<N> sorted = detail::sortFilters(filters);
+        StaticTable<Words> table = {};
+
+        if (detail::staticWords(sorted.counts) != Words)
+            detail::staticTableSizeMismatch();
+
+        for (int s = 0; s < 4; s++) {
+            table.counts[s] = sorted.counts[s];
+        }
+
+        table.SFF_sa     = 0;
+        table.SFF_GRP_sa = table.SFF_sa + (((table.counts[0] + 1) / 2) * 4);
+        table.EFF_sa     = table.SFF_GRP_sa + (table.counts[1] * 4);
+        table.EFF_GRP_sa = table.EFF_sa + (table.counts[2] * 4);
+        table.ENDofTable = table.EFF_GRP_sa + ((table.counts[3] * 2) * 4);
+
+        //Filters are sorted by section, so the words come out in table order
+        size_t word = 0;
+        size_t standard = 0;
+        for (size_t i = 0; i < sorted.count; i++) {
+            const StaticFilter & filter = sorted.filters[i];
+            switch (filter.section) {
+                case FilterSection::standard:
+                    //Two to a word, lower id in the MSB. An odd count leaves
+                    //a disabled entry in the last LSB.
+                    if (standard % 2 == 0) {
+                        table.words[word] = (filter.first << 16) | 0x0000FFFF;
+                    } else {
+                        table.words[word] = (table.words[word] & 0xFFFF0000) | filter.first;
+                        word++;
+                    }
+                    standard++;
+                    break;
+                case FilterSection::standardGroup:
+                    word += standard % 2;
+                    standard = 0;
+                    table.words[word++] = (filter.first << 16) | filter.last;
+                    break;
+                case FilterSection::extended:
+                    word += standard % 2;
+                    standard = 0;
+                    table.words[word++] = filter.first;
+                    break;
+                default:
+                    word += standard % 2;
+                    standard = 0;
+                    table.words[word++] = filter.first;
+                    table.words[word++] = filter.last;
+                    break;
+            }
+        }
+
+        return table;
+    }
+
+    /**
+     * Copy a static table into the acceptance filter in one pass.
+     */
+    template <unsigned short Words>
+    int loadStaticTable(const StaticTable<Words> & table) {
+        return loadStaticTable(table.words, Words, table.counts);
+    }
+}
+
+#endif